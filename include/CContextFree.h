@@ -6,6 +6,13 @@
 #include <CBBox2D.h>
 #include <vector>
 #include <map>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <type_traits>
 
 class CFile;
 class CStrParse;
@@ -45,7 +52,201 @@ class COptValT {
   void setInvalid() { valid_ = false; }
 };
 
+// growable array stored in chunks of doubling size (first chunk has 2^BASE_BITS
+// elements) so elements never move when it grows, clear() keeps the chunks for
+// reuse and release() frees them
+template<typename T, unsigned BASE_BITS=6>
+class CChunkArrayT {
+ public:
+  template<bool CONST>
+  class IteratorT {
+   public:
+    using Array = typename std::conditional<CONST, const CChunkArrayT, CChunkArrayT>::type;
+
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type        = T;
+    using difference_type   = std::ptrdiff_t;
+    using pointer           = typename std::conditional<CONST, const T *, T *>::type;
+    using reference         = typename std::conditional<CONST, const T &, T &>::type;
+
+    IteratorT(Array *a=nullptr, size_t i=0) : a_(a), i_(i) { }
+
+    reference operator*() const { return (*a_)[i_]; }
+    pointer operator->() const { return &(*a_)[i_]; }
+    reference operator[](difference_type n) const { return (*a_)[i_ + n]; }
+
+    IteratorT &operator++() { ++i_; return *this; }
+    IteratorT &operator--() { --i_; return *this; }
+    IteratorT operator++(int) { IteratorT t = *this; ++i_; return t; }
+    IteratorT operator--(int) { IteratorT t = *this; --i_; return t; }
+
+    IteratorT &operator+=(difference_type n) { i_ += n; return *this; }
+    IteratorT &operator-=(difference_type n) { i_ -= n; return *this; }
+
+    IteratorT operator+(difference_type n) const { return IteratorT(a_, i_ + n); }
+    IteratorT operator-(difference_type n) const { return IteratorT(a_, i_ - n); }
+
+    friend IteratorT operator+(difference_type n, const IteratorT &i) { return i + n; }
+
+    difference_type operator-(const IteratorT &rhs) const {
+      return difference_type(i_) - difference_type(rhs.i_); }
+
+    bool operator==(const IteratorT &rhs) const { return i_ == rhs.i_; }
+    bool operator!=(const IteratorT &rhs) const { return i_ != rhs.i_; }
+    bool operator< (const IteratorT &rhs) const { return i_ <  rhs.i_; }
+    bool operator> (const IteratorT &rhs) const { return i_ >  rhs.i_; }
+    bool operator<=(const IteratorT &rhs) const { return i_ <= rhs.i_; }
+    bool operator>=(const IteratorT &rhs) const { return i_ >= rhs.i_; }
+
+   private:
+    Array  *a_ { nullptr };
+    size_t  i_ { 0 };
+  };
+
+  using iterator       = IteratorT<false>;
+  using const_iterator = IteratorT<true>;
+
+ public:
+  CChunkArrayT() { }
+
+  CChunkArrayT(const CChunkArrayT &rhs) { append(rhs.begin(), rhs.end()); }
+
+  CChunkArrayT(CChunkArrayT &&rhs) { swap(rhs); }
+
+ ~CChunkArrayT() { release(); }
+
+  CChunkArrayT &operator=(const CChunkArrayT &rhs) {
+    if (this != &rhs) { clear(); append(rhs.begin(), rhs.end()); }
+    return *this;
+  }
+
+  CChunkArrayT &operator=(CChunkArrayT &&rhs) { swap(rhs); return *this; }
+
+  void swap(CChunkArrayT &rhs) {
+    std::swap(chunks_, rhs.chunks_); std::swap(size_, rhs.size_);
+    std::swap(capacity_, rhs.capacity_);
+  }
+
+  size_t size() const { return size_; }
+
+  bool empty() const { return (size_ == 0); }
+
+  size_t capacity() const { return capacity_; }
+
+  // number of elements stored contiguously from i (to end of its chunk or array)
+  size_t contiguous(size_t i) const {
+    size_t o; uint k = chunkIndex(i, &o);
+    return std::min((size_t(1) << (BASE_BITS + k)) - o, size_ - i);
+  }
+
+  // allocate chunks for at least n elements
+  void reserve(size_t n) {
+    while (capacity_ < n) addChunk();
+  }
+
+  T       &operator[](size_t i)       { size_t o; uint k = chunkIndex(i, &o); return chunks_[k][o]; }
+  const T &operator[](size_t i) const { size_t o; uint k = chunkIndex(i, &o); return chunks_[k][o]; }
+
+  T       &front()       { return (*this)[0]; }
+  const T &front() const { return (*this)[0]; }
+
+  T       &back()       { return (*this)[size_ - 1]; }
+  const T &back() const { return (*this)[size_ - 1]; }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end  () { return iterator(this, size_); }
+
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end  () const { return const_iterator(this, size_); }
+
+  void push_back(const T &t) {
+    if (size_ == capacity_) addChunk();
+
+    new (&(*this)[size_]) T(t);
+
+    ++size_;
+  }
+
+  void pop_back() {
+    --size_;
+
+    (*this)[size_].~T();
+  }
+
+  template<typename ITER>
+  void append(ITER first, ITER last) {
+    for ( ; first != last; ++first)
+      push_back(*first);
+  }
+
+  // remove all elements (chunks are kept)
+  void clear() {
+    if (! std::is_trivially_destructible<T>::value) {
+      for (size_t i = 0; i < size_; ++i)
+        (*this)[i].~T();
+    }
+
+    size_ = 0;
+  }
+
+  // remove all elements and free chunks
+  void release() {
+    clear();
+
+    for (auto &chunk : chunks_)
+      ::operator delete(chunk);
+
+    chunks_.clear();
+
+    capacity_ = 0;
+  }
+
+ private:
+  static uint chunkIndex(size_t i, size_t *offset) {
+    // chunk k holds elements [2^(BASE_BITS + k) - 2^BASE_BITS, 2^(BASE_BITS + k + 1) - 2^BASE_BITS)
+    size_t p = i + (size_t(1) << BASE_BITS);
+
+    uint hb = highBit(p);
+
+    *offset = p - (size_t(1) << hb);
+
+    return hb - BASE_BITS;
+  }
+
+  // index of highest set bit (v > 0)
+  static uint highBit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - uint(__builtin_clzll((unsigned long long) v));
+#else
+    uint b = 0;
+
+    if (v >> 32) { v >>= 32; b += 32; }
+    if (v >> 16) { v >>= 16; b += 16; }
+    if (v >>  8) { v >>=  8; b +=  8; }
+    if (v >>  4) { v >>=  4; b +=  4; }
+    if (v >>  2) { v >>=  2; b +=  2; }
+    if (v >>  1) {           b +=  1; }
+
+    return b;
+#endif
+  }
+
+  void addChunk() {
+    size_t n = size_t(1) << (BASE_BITS + chunks_.size());
+
+    chunks_.push_back(static_cast<T *>(::operator new(n*sizeof(T))));
+
+    capacity_ += n;
+  }
+
+ private:
+  std::vector<T *> chunks_;
+  size_t           size_     { 0 };
+  size_t           capacity_ { 0 };
+};
+
 class CContextFreePath;
+struct CContextFreePathCache;
 
 //---
 
@@ -68,8 +269,25 @@ class CContextFree {
     NO_PATH_OP
   };
 
+  enum ExpandMode {
+    BREADTH_FIRST_EXPAND, // expand one generation at a time
+    DEPTH_FIRST_EXPAND,   // expand each rule's children before its siblings
+    HYBRID_EXPAND,        // breadth first until frontier exceeds max frontier
+    PRIORITY_EXPAND       // largest pending rule first (best shapes for max shapes budget)
+  };
+
  public:
   struct Adjustment {
+    // adjustment kind flags (see buildKind) used to select adjustState fast path
+    enum Kind {
+      KIND_TRANSLATE = (1<<0), // matrix has translation
+      KIND_LINEAR    = (1<<1), // matrix has rotate, scale, flip or skew
+      KIND_DEPTH     = (1<<2), // z or z scale
+      KIND_SIMILAR   = (1<<3), // linear part is rotate, uniform scale and flip only
+      KIND_COLOR     = (1<<4), // hue, saturation, brightness or alpha
+      KIND_LCOLOR    = (1<<5)  // target hue, saturation, brightness or alpha
+    };
+
     Adjustment() :
      x(), y(), z(), sx(), sy(), sz(), rotate(), flip(), skew_x(), skew_y(),
      hue(), saturation(), brightness(), alpha(),
@@ -81,6 +299,8 @@ class CContextFree {
 
     void buildMatrix();
 
+    void buildKind();
+
     COptValT<double> x, y, z;
     COptValT<double> sx, sy, sz;
     COptValT<double> rotate;
@@ -90,8 +310,81 @@ class CContextFree {
     COptValT<double> lhue, lsaturation, lbrightness, lalpha;
     bool             thue, tsaturation, tbrightness, talpha;
     CMatrix2D        m;
+    uint             kind { 0 };
+    double           tx   { 0.0 }, ty { 0.0 };   // matrix translation
+    double           smin { 1.0 }, smax { 1.0 }; // matrix singular values (with rounding margin)
+    double           s    { 1.0 };               // matrix scale (similarity)
+  };
+
+  class Rule;
+
+  // compiled rule instruction (see compileRules), action lists are lowered to a flat
+  // array of these with resolved rules and adjustments and run by execCode
+  enum InstrOp {
+    PUSH_RULE_INSTR,  // push adjusted state for non-basic rule
+    EMIT_SHAPE_INSTR, // expand basic rule (shape or path) for adjusted state
+    LOOP_BEGIN_INSTR, // start loop of n iterations (jump to end if none)
+    LOOP_CHECK_INSTR, // complex loop iteration size check (jump to end if too small)
+    LOOP_END_INSTR,   // apply loop adjustment and jump back if more iterations
+    END_INSTR
   };
 
+  struct Instr {
+    InstrOp           op   { END_INSTR };
+    bool              loop { false };   // push/emit is body of simple loop
+    bool              tail { false };   // push is last and only non-basic child (see Rule::expand)
+    int               n    { 0 };       // loop count
+    uint              salt { 0 };       // child seed salt (action index + 1)
+    uint              jump { 0 };       // jump target
+    const Adjustment *adj  { nullptr };
+    Rule             *rule { nullptr };
+  };
+
+  using Code = std::vector<Instr>;
+
+  struct ExpandStats {
+    uint num_generations { 0 };
+    uint num_expanded    { 0 }; // number of rule states expanded
+    uint peak_frontier   { 0 }; // maximum number of pending rule states
+    uint num_chained     { 0 }; // rule states expanded in place as tail of a rule chain
+
+    void reset() { *this = ExpandStats(); }
+  };
+
+  // static estimate of expansion cost (see estimateCost)
+  struct CostEstimate {
+    double                   num_shapes    { 0.0 };   // expected number of shapes
+    double                   num_expanded  { 0.0 };   // expected number of rule states expanded
+    double                   peak_frontier { 0.0 };   // expected largest generation
+    uint                     depth         { 0 };     // number of generations
+    bool                     limited       { false }; // stopped by max shapes (or depth)
+    std::vector<std::string> cycles;                  // rules in non-contracting cycles
+  };
+
+  // called for each child rule of action with its scale and expected count
+  using ChildProc = std::function<void (Rule *rule, double s, double p)>;
+
+  // kind of buffered shape
+  enum ShapeKind {
+    SQUARE_SHAPE,
+    CIRCLE_SHAPE,
+    TRIANGLE_SHAPE,
+    PATH_SHAPE
+  };
+
+  // packed buffered shape (32 bytes), paths only store index of full rule state
+  struct ShapeRecord {
+    float    m[6]  { 1, 0, 0, 1, 0, 0 }; // matrix values (CMatrix2D::getValues order)
+    uint32_t color { 0 };                // RGBA8 color (r in low byte), path state index for path
+    uint32_t key   { 0 };                // bbox area float bits (low 2 bits are shape kind)
+
+    ShapeKind getKind() const { return ShapeKind(key & 3); }
+
+    float getArea() const;
+  };
+
+  static_assert(sizeof(ShapeRecord) == 32, "ShapeRecord size");
+
   struct Tile {
     bool             is_set;
     COptValT<double> x, y;
@@ -125,16 +418,38 @@ class CContextFree {
     }
   };
 
+  // counter based (SplitMix64) random numbers so each rule state's random choices only
+  // depend on its seed, which is derived from its parent's seed and its action position
+  struct Rand {
+    static uint64_t mix(uint64_t z) {
+      z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+
+      return z ^ (z >> 31);
+    }
+
+    // n'th value of stream for seed (also used as seed for n'th child)
+    static uint64_t value(uint64_t seed, uint64_t n) {
+      return mix(seed + (n + 1)*0x9e3779b97f4a7c15ULL);
+    }
+
+    static double randIn(uint64_t seed, uint64_t n, double min_val, double max_val) {
+      return (max_val - min_val)*((value(seed, n) >> 11)*(1.0/9007199254740992.0)) + min_val;
+    }
+  };
+
   struct State {
     CHSVA     color;
     CHSVA     lcolor;
     double    z;
     double    sz;
     CMatrix2D m;
+    uint64_t  seed;
+    double    smin, smax; // conservative bounds of matrix scale (singular values)
 
     State() :
      color(0.0, 0.0, 0.0, 1.0), lcolor(0.0, 0.0, 0.0, 1.0),
-     z(0.0), sz(1.0), m() {
+     z(0.0), sz(1.0), m(), seed(0), smin(1.0), smax(1.0) {
       m.setIdentity();
     }
   };
@@ -362,17 +677,38 @@ class CContextFree {
     PartList   parts_;
   };
 
-  class Rule;
-
   class Action {
    public:
     Action() { }
 
     virtual ~Action() { }
 
+    // position in parent action list (salt for child seeds)
+    uint getIndex() const { return index_; }
+    void setIndex(uint index) { index_ = index; }
+
+    virtual void resolve(CContextFree *) { }
+
+    // radius about local origin of everything drawn by action from current rule
+    // bounds (see calcRuleBounds), infinite if not known
+    virtual double calcBound() const { return std::numeric_limits<double>::infinity(); }
+
+    // children of action for state of scale s (expected count p), children smaller
+    // than limit are skipped
+    virtual void visitChildren(double, double, double, const ChildProc &) const { }
+
+    // append instructions for action, returns false if it can't be compiled
+    virtual bool compile(Code &) const { return false; }
+
     virtual void exec(CContextFree *c, const State &state) = 0;
 
     virtual void expand(CContextFree *c, const State &state) = 0;
+
+   protected:
+    uint64_t childSeed(const State &state) const { return Rand::value(state.seed, index_ + 1); }
+
+   protected:
+    uint index_ { 0 };
   };
 
   class SimpleAction : public Action {
@@ -385,6 +721,14 @@ class CContextFree {
 
     const Adjustment &getAdjustment() const { return adj_; }
 
+    void resolve(CContextFree *c) override;
+
+    double calcBound() const override;
+
+    void visitChildren(double s, double p, double limit, const ChildProc &proc) const override;
+
+    bool compile(Code &code) const override;
+
     void exec(CContextFree *c, const State &state) override;
 
     void expand(CContextFree *c, const State &state) override;
@@ -409,6 +753,14 @@ class CContextFree {
 
     const Adjustment &getAdjustment() const { return adj_; }
 
+    void resolve(CContextFree *c) override;
+
+    double calcBound() const override;
+
+    void visitChildren(double s, double p, double limit, const ChildProc &proc) const override;
+
+    bool compile(Code &code) const override;
+
     void exec(CContextFree *c, const State &state) override;
 
     void expand(CContextFree *c, const State &state) override;
@@ -433,6 +785,14 @@ class CContextFree {
 
     Action *getAction() const { return action_; }
 
+    void resolve(CContextFree *c) override;
+
+    double calcBound() const override;
+
+    void visitChildren(double s, double p, double limit, const ChildProc &proc) const override;
+
+    bool compile(Code &code) const override;
+
     void exec(CContextFree *c, const State &state) override;
 
     void expand(CContextFree *c, const State &state) override;
@@ -453,6 +813,8 @@ class CContextFree {
 
     void addPart(PathPart *part);
 
+    void resolve(CContextFree *c) override;
+
     void exec(CContextFree *c, const State &state) override;
 
     void expand(CContextFree *c, const State &state) override;
@@ -460,8 +822,9 @@ class CContextFree {
    private:
     using PartList = std::vector<PathPart *>;
 
-    Path     *path_;
-    PartList  parts_;
+    Path                    *path_;
+    PartList                 parts_;
+    CContextFreePathCache   *cache_ { nullptr }; // recorded geometry (see resolve)
   };
 
   class ActionList {
@@ -475,9 +838,22 @@ class CContextFree {
     double getWeight() const { return weight_; }
 
     void addAction(Action *action) {
+      action->setIndex(uint(actions_.size()));
+
       actions_.push_back(action);
     }
 
+    void resolve(CContextFree *c);
+
+    double calcBound() const;
+
+    void visitChildren(double s, double p, double limit, const ChildProc &proc) const;
+
+    void compile(Code &code);
+
+    // start of compiled code (-1 if not compiled)
+    int codeStart() const { return codeStart_; }
+
     void exec(CContextFree *c, const State &state);
 
     void expand(CContextFree *c, const State &state);
@@ -485,9 +861,10 @@ class CContextFree {
    private:
     using ActionArray = std::vector<Action *>;
 
-    Rule        *rule_   { nullptr };
-    double       weight_ { 1.0 };
+    Rule        *rule_      { nullptr };
+    double       weight_    { 1.0 };
     ActionArray  actions_;
+    int          codeStart_ { -1 };
   };
 
   class Rule {
@@ -498,24 +875,53 @@ class CContextFree {
 
     virtual bool isBasic() const { return false; }
 
+    // kind of shape buffered by basic rule
+    virtual ShapeKind getShapeKind() const { return PATH_SHAPE; }
+
     void addActionList(ActionList *actionList);
 
     virtual const std::string &getName() const { return id_; }
 
+    void resolve();
+
+    // conservative radius about local origin of everything the rule draws
+    double getBound() const { return bound_; }
+    void setBound(double r) { bound_ = r; }
+
+    // bound from action lists using current bounds of child rules
+    virtual double calcBound();
+
+    // children of all action lists weighted by their probability
+    void visitChildren(double s, double p, double limit, const ChildProc &proc) const;
+
+    void compile(Code &code);
+
     virtual void expand(const State &state);
 
     virtual void exec(const State &state);
 
    protected:
-    ActionList *getActionList();
+    ActionList *getActionList(const State &state);
+
+    void buildAliasTable();
 
    protected:
+    // Vose alias table entry for weighted action list choice (list is chosen with
+    // probability prob, otherwise its alias is used)
+    struct Alias {
+      double prob  { 1.0 };
+      uint   alias { 0 };
+    };
+
     using ActionListArray = std::vector<ActionList *>;
+    using AliasTable      = std::vector<Alias>;
 
     CContextFree*   c_           { nullptr };
     std::string     id_;
     double          totalWeight_ { 0.0 };
     ActionListArray actionLists_;
+    AliasTable      aliasTable_;
+    double          bound_       { 0.0 };
   };
 
   class SquareRule : public Rule {
@@ -524,6 +930,10 @@ class CContextFree {
 
     bool isBasic() const override;
 
+    ShapeKind getShapeKind() const override { return SQUARE_SHAPE; }
+
+    double calcBound() override;
+
     void expand(const State &state) override;
 
     void exec(const State &state) override;
@@ -535,6 +945,10 @@ class CContextFree {
 
     bool isBasic() const override;
 
+    ShapeKind getShapeKind() const override { return CIRCLE_SHAPE; }
+
+    double calcBound() override;
+
     void expand(const State &state) override;
 
     void exec(const State &state) override;
@@ -546,6 +960,10 @@ class CContextFree {
 
     bool isBasic() const override;
 
+    ShapeKind getShapeKind() const override { return TRIANGLE_SHAPE; }
+
+    double calcBound() override;
+
     void expand(const State &state) override;
 
     void exec(const State &state) override;
@@ -573,7 +991,7 @@ class CContextFree {
    private:
     Rule   *rule_;
     State   state_;
-    double  area_;
+    double  area_; // bbox area of buffered shape, squared size of pending rule (priority mode)
   };
 
   class Path : public Rule {
@@ -582,9 +1000,14 @@ class CContextFree {
 
     bool isBasic() const override { return true; }
 
+    double calcBound() override;
+
     void expand(const State &state) override;
 
     void exec(const State &state) override;
+
+   private:
+    double pathBound_ { -1.0 }; // measured path geometry radius
   };
 
  public:
@@ -599,32 +1022,118 @@ class CContextFree {
 
   uint getNumShapes() const { return num_shapes_; }
 
-  void setMinSize(double min_size) { min_size_ = min_size; }
+  void setExpandMode(ExpandMode mode) { expandMode_ = mode; }
+  ExpandMode getExpandMode() const { return expandMode_; }
+
+  // frontier size at which hybrid mode switches to depth first
+  void setMaxFrontier(uint max_frontier) { max_frontier_ = max_frontier; }
+  uint getMaxFrontier() const { return max_frontier_; }
+
+  const ExpandStats &getExpandStats() const { return expandStats_; }
+
+  // estimate expansion cost for current pixel size, min size and max shapes from the
+  // rule graph (action list weights, adjustment scales and loop counts) without
+  // expanding, also finds recursion which doesn't shrink (only ended by max shapes)
+  bool estimateCost(CostEstimate &cost);
+
+  // expand using compiled rule code (default) or action objects
+  void setCompileRules(bool b) { compileRules_ = b; }
+  bool getCompileRules() const { return compileRules_; }
+
+  // seed for random rule choices and rand_static values (random seed from time if not
+  // set, set before parse to change rand_static values)
+  void setSeed(uint64_t seed) { seed_ = seed; seedSet_ = true; }
+  uint64_t getSeed() const { return seed_; }
 
-  void setPixelSize(double pixelSize) { pixelSize_ = pixelSize; }
+  void setVariation(const std::string &variation);
+
+  // number of threads used to expand each generation (1 = serial, 0 = all cores)
+  void setNumThreads(uint num_threads) { num_threads_ = num_threads; }
+  uint getNumThreads() const;
+
+  void setMinSize(double min_size) { min_size_ = min_size; updateSizeLimits(); }
+
+  void setPixelSize(double pixelSize) { pixelSize_ = pixelSize; updateSizeLimits(); }
+
+  // only expand rules which can draw inside clip (same coords as getBBox), each rule
+  // has a conservative bound so no shape inside the clip is lost (tiled designs are
+  // not clipped)
+  void setClip(const CBBox2D &clip) { clip_ = clip; }
+  void resetClip() { clip_ = CBBox2D(); }
+  const CBBox2D &getClip() const { return clip_; }
 
   bool parse(const std::string &fileName);
 
+  using TimePoint = std::chrono::steady_clock::time_point;
+
   virtual void expand();
 
+  // expand at most n rules or until time budget is used, returns true when expansion is
+  // complete. The pending rules are kept so the next call resumes where this one stopped.
+  // A new expansion is started if none has been run since parse, once complete further
+  // calls just return true (use restartExpand to expand again).
+  bool expandSteps(uint n);
+
+  bool expandUntil(const TimePoint &end_time);
+
+  template<typename Rep, typename Period>
+  bool expandFor(const std::chrono::duration<Rep, Period> &d) {
+    return expandUntil(std::chrono::steady_clock::now() +
+                       std::chrono::duration_cast<std::chrono::steady_clock::duration>(d));
+  }
+
+  // discard any pending or completed expansion and start a new one (for expandSteps)
+  bool restartExpand() { return startExpand(); }
+
+  bool isExpanding() const { return expanding_; }
+
+  bool isExpandDone() const { return expandDone_; }
+
   virtual bool tick() { return true; }
 
   const CBBox2D &getBBox() const { return bbox_; }
 
   virtual void render();
 
+  // render only shapes whose bbox intersects view (uses spatial index over the
+  // buffered shapes which is built on first use after expansion)
+  virtual void render(const CBBox2D &view);
+
+  // expand and render at the same time: shapes are passed through a bounded queue to a
+  // render thread as they are created instead of being buffered. Shapes are drawn in
+  // creation order (no z or area sort) and tiles are not repeated, nothing is left to
+  // render() afterwards. The fill and path methods are called from the render thread.
+  void expandAndRender();
+
   void renderAt(double x, double y);
 
+  void renderAt(double x, double y, const CBBox2D &view);
+
   bool getTile(double *xmin, double *ymin, double *xmax, double *ymax);
 
   virtual void fillBackground(const CHSVA &hsva);
 
+  // draw a run of buffered square, circle and triangle records in paint order, the
+  // final transform of each is m times its record matrix and colors are RGBA8. Records
+  // stay valid until render returns so a backend can keep pointers to them. Default
+  // calls the RGBA8 fillSquare/fillCircle/fillTriangle for each record so a backend
+  // overrides it to share setup (transform, color conversion) across the run
+  virtual void renderBatch(const ShapeRecord *shapes, uint n, const CMatrix2D &m);
+
   virtual void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
                             const CHSVA &color);
   virtual void fillCircle  (double x, double y, double r, const CMatrix2D &m, const CHSVA &color);
   virtual void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
                             const CMatrix2D &m, const CHSVA &color);
 
+  // RGBA8 color (r in low byte) versions used for buffered shapes, default converts back
+  // to HSVA for backends which only implement the above
+  virtual void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
+                            uint32_t rgba);
+  virtual void fillCircle  (double x, double y, double r, const CMatrix2D &m, uint32_t rgba);
+  virtual void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+                            const CMatrix2D &m, uint32_t rgba);
+
   virtual void pathInit   ();
   virtual void pathTerm   ();
   virtual void pathMoveTo (double x, double y);
@@ -636,6 +1145,15 @@ class CContextFree {
 
   static State adjustState(const State &state, const Adjustment &adj);
 
+  bool adjustChildState(const State &state, const Adjustment &adj, State &state1);
+
+  static void adjustTransform(State &state, const Adjustment &adj);
+
+  template<uint KIND>
+  static void adjustTransformT(State &state, const Adjustment &adj);
+
+  static void adjustColor(State &state, const Adjustment &adj);
+
   static double adjustHueValue(double base, double delta,
                                double target=0.0, bool useTarget=false);
   static double adjustColorValue(double base, double delta,
@@ -645,9 +1163,13 @@ class CContextFree {
 
   bool checkSizeLimit(const State &state);
 
-  bool checkMaxShapes() const;
+  bool checkClip(const Rule *rule, const State &state) const;
+
+  void updateSizeLimits();
+
+  static double getStateSize(const State &state);
 
-  static double randIn(double r1, double r2);
+  bool checkMaxShapes() const;
 
  private:
   bool parseFile(const std::string &fileName);
@@ -692,12 +1214,40 @@ class CContextFree {
 
   bool parseRealValue(double *r);
 
+  bool evalExpr(const std::string &expr, double *r);
+
   void skipSpace();
 
   bool skipComment();
 
   void bufferShapes();
 
+  void resolveRules();
+
+  void compileRules();
+
+  void calcRuleBounds();
+
+  void findNonContractingCycles(Rule *start, std::vector<std::string> &names);
+
+  Rule *execCode(uint pc, const State &state, State *tailState=nullptr);
+
+  struct ExpandBuffer;
+  class  StreamQueue;
+
+  bool startExpand();
+  void finishExpand();
+
+  bool expandRules(uint max_rules, const TimePoint *end_time);
+
+  void startGeneration();
+
+  void expandDepthFirst();
+  void expandPriority();
+  uint expandParallel(CChunkArrayT<RuleState> &ruleStack, uint i1, uint i2);
+
+  void mergeExpandBuffer(ExpandBuffer &buffer);
+
   const std::string &getStartShape() const { return start_shape_; }
 
   void setStartShape(const std::string &name);
@@ -707,13 +1257,50 @@ class CContextFree {
 
   void pushRule(Rule *rule, const State &state);
 
+  void pushRuleState(Rule *rule, const State &state);
+
   void dumpRuleStack();
 
   void bufferRule(double z, Rule *rule, const State &state, const CBBox2D &bbox);
 
-  void incNumShapes() { ++num_shapes_; }
+  struct ShapeBuffer;
+
+  void renderTiles(const CBBox2D *view);
+
+  void sortShapes();
+
+  void buildSpatialIndex();
+
+  void bufferPrimitive(Rule *rule, const State &state);
+
+  void shapeBuffered(ShapeBuffer *shapeBuffer);
+
+  void boundShapes();
+
+  static void boundShapes(ShapeBuffer &buffer, CBBox2D &bbox);
+
+  static void calcShapeExtents(const ShapeRecord *shapes, uint n, float *bboxes);
+
+  struct ShapeColor;
+
+  static void calcShapeColors(const ShapeColor *colors, uint n, uint32_t *rgba);
+
+  static uint32_t depthKey(double z);
+
+  static void setAreaKey(ShapeRecord &shape, float area);
 
-  CContextFreePath *getPath() { return path_; }
+  void renderShape(const ShapeRecord &shape, const ShapeBuffer *buffer);
+
+  void renderShapes(const ShapeRecord *shapes, uint n, const ShapeBuffer *buffer);
+
+  static uint32_t packColor(const CHSVA &color);
+  static CHSVA    unpackColor(uint32_t color);
+
+  void incNumShapes();
+
+  bool checkMaxShapesBase(uint num_shapes) const;
+
+  CContextFreePath *getPath();
 
   void updateBBox(const CBBox2D &bbox);
 
@@ -722,8 +1309,62 @@ class CContextFree {
  private:
   using StringArray    = std::vector<std::string>;
   using RuleMap        = std::map<std::string, Rule *>;
-  using RuleStateStack = std::vector<RuleState>;
-  using ZRuleStack     = std::map<int, RuleStateStack>;
+  using RuleStateStack = CChunkArrayT<RuleState>;
+  using ShapeStack     = CChunkArrayT<ShapeRecord>;
+
+  using KeyStack       = CChunkArrayT<uint64_t>;
+  using BBoxStack      = CChunkArrayT<CBBox2D>;
+
+  // HSVA of buffered shape waiting for conversion to packed RGBA
+  struct ShapeColor {
+    float h { 0.0f }, s { 0.0f }, v { 0.0f }, a { 0.0f };
+  };
+
+  using ColorArray = std::vector<ShapeColor>;
+
+  // buffered shapes in creation order with their sort keys (z then area), path
+  // shapes index paths (and their bboxes). Primitive shapes are bounded (area key set
+  // and bbox added) and their colors (one per shape from numBounded) packed in blocks
+  // by boundShapes
+  struct ShapeBuffer {
+    // shapes bounded (and colors packed) per block, also max size of colors
+    static const uint block_size = 256;
+
+    ShapeStack     shapes;
+    KeyStack       keys;
+    RuleStateStack paths;
+    BBoxStack      pathBBoxes;
+    ColorArray     colors;
+    size_t         numBounded { 0 }; // number of bounded shapes
+
+    void release() {
+      shapes.release(); keys.release(); paths.release(); pathBBoxes.release();
+
+      colors.clear();
+
+      numBounded = 0;
+    }
+  };
+
+  // uniform grid over sorted shape bboxes, each cell lists shapes in render order,
+  // shapes covering many cells are kept in a separate list
+  struct SpatialIndex {
+    using Indices = std::vector<uint32_t>;
+    using Floats  = std::vector<float>;
+
+    bool    valid { false };
+    double  xmin { 0.0 }, ymin { 0.0 };
+    double  cw   { 1.0 }, ch   { 1.0 }; // cell size
+    uint    nx   { 0 }  , ny   { 0 };   // number of cells
+    Indices cellStart;                  // start of cell's shapes in cellShapes (nx*ny + 1)
+    Indices cellShapes;
+    Indices largeShapes;
+    Floats  bboxes;                     // shape bboxes (xmin, ymin, xmax, ymax)
+
+    Indices viewShapes;                 // render scratch: visible shape indices
+
+    void reset() { *this = SpatialIndex(); }
+  };
 
   CContextFreeParse *parse_       { nullptr };
   std::string        start_shape_;
@@ -731,76 +1372,58 @@ class CContextFree {
   Tile               tile_;
   RuleMap            rules_;
   RuleStateStack     ruleStack_;
+  RuleStateStack     genStack_;
+  uint               genPos_      { 0 };
+  bool               genStarted_  { false };
+  ExpandMode         genMode_     { BREADTH_FIRST_EXPAND };
+  bool               expanding_   { false };
+  bool               expandDone_  { false };
   StringArray        includes_;
   uint               num_shapes_ { 0 };
+  uint               num_threads_ { 1 };
+  uint64_t           seed_        { 0 };
+  bool               seedSet_     { false };
+  uint64_t           randStaticSeed_  { 0 };
+  uint64_t           randStaticCount_ { 0 };
+  ExpandMode         expandMode_  { BREADTH_FIRST_EXPAND };
+  uint               max_frontier_ { 100000 };
+  ExpandStats        expandStats_;
+  StreamQueue       *streamQueue_ { nullptr };
+  Code               code_;
+  bool               compileRules_ { true };
   uint               max_shapes_ { 500000 };
   double             min_size_   { 0.3 };
-  ZRuleStack         zRuleStack_;
+  ShapeBuffer        shapeBuffer_;
+  bool               shapesSorted_ { true }; // shape buffer in render order
+  SpatialIndex       spatialIndex_;
   double             pixelSize_  { 1.0 };
+  double             sizeCullLimit_ { 0.3*(1 - 1E-9) }; // scale bound below this is culled
+  double             sizeKeepLimit_ { 0.3*(1 + 1E-9) }; // scale bound above this is kept
   CContextFreePath  *path_       { nullptr };
   CBBox2D            bbox_;
+  CBBox2D            clip_;
+  double             strokeMargin_ { 0.0 }; // max stroke half width (not scaled)
   CMatrix2D          adjustMatrix_;
-};
-
-//-------------
-
-class CContextFreePathPart {
- public:
-  CContextFreePathPart() { }
-
-  virtual ~CContextFreePathPart() { }
 
-  virtual void updateBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox) = 0;
-
-  virtual void addToPath(CContextFree *c) = 0;
-};
-
-class CContextFreePathMoveTo : public CContextFreePathPart {
- public:
-  CContextFreePathMoveTo(double x, double y);
-
-  void updateBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox) override;
-
-  void addToPath(CContextFree *c) override;
-
- private:
-  double x_, y_;
+  static thread_local ExpandBuffer *expandBuffer_;
 };
 
-class CContextFreePathLineTo : public CContextFreePathPart {
- public:
-  CContextFreePathLineTo(double x, double y);
-
-  void updateBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox) override;
-
-  void addToPath(CContextFree *c) override;
-
- private:
-  double x_, y_;
-};
-
-class CContextFreePathCurve3To : public CContextFreePathPart {
- public:
-  CContextFreePathCurve3To(double x2, double y2, double x3, double y3, double x4, double y4);
-
-  void updateBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox) override;
-
-  void addToPath(CContextFree *c) override;
-
- private:
-  double x2_, y2_, x3_, y3_, x4_, y4_;
-};
+//-------------
 
-class CContextFreePathClose : public CContextFreePathPart {
+class CContextFreePath {
  public:
-  CContextFreePathClose();
+  enum Verb : uint8_t {
+    MOVE_TO_VERB,  // 2 coords
+    LINE_TO_VERB,  // 2 coords
+    CURVE_TO_VERB, // 6 coords
+    CLOSE_VERB     // 0 coords
+  };
 
-  void updateBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox) override;
+  using Verbs  = std::vector<Verb>;
+  using Coords = std::vector<double>;
 
-  void addToPath(CContextFree *c) override;
-};
+  using Cache = CContextFreePathCache;
 
-class CContextFreePath {
  public:
   CContextFreePath();
  ~CContextFreePath();
@@ -811,7 +1434,10 @@ class CContextFreePath {
 
   void reset();
 
-  void addPart(CContextFreePathPart *part);
+  void moveTo (double x, double y);
+  void lineTo (double x, double y);
+  void curveTo(double x2, double y2, double x3, double y3, double x4, double y4);
+  void close  ();
 
   void setClosed(bool closed) { closed_ = closed; }
 
@@ -839,16 +1465,66 @@ class CContextFreePath {
 
   const CBBox2D &getBBox() const { return bbox_; }
 
+  // record fill/stroke geometry into cache (nothing is drawn)
+  void startRecord(Cache *cache) { record_ = cache; }
+
+  // take fill/stroke geometry from cache (path commands are not built)
+  void startReplay(const Cache *cache) { replay_ = cache; replayPos_ = 0; }
+
+  void endCache() { record_ = nullptr; replay_ = nullptr; }
+
+  bool isReplay() const { return replay_; }
+
+  // replayed path has draw left (implicit fill of unfilled/unstroked path)
+  bool hasReplayDraw() const;
+
  private:
-  using PartList = std::vector<CContextFreePathPart *>;
+  struct Geom {
+    const Verb    *verbs      { nullptr };
+    uint           num_verbs  { 0 };
+    const double  *coords     { nullptr };
+    uint           num_coords { 0 };
+    const CBBox2D *bbox       { nullptr };
+  };
+
+  bool recordDraw();
+
+  Geom drawGeom();
 
-  PartList parts_;
+  static void geomBBox(const Geom &geom, const CContextFree::State &state, CBBox2D &bbox);
+
+  static void addToPath(CContextFree *c, const Geom &geom);
+
+ private:
+  // path commands and their packed coordinates (storage reused when cleared)
+  Verbs    verbs_;
+  Coords   coords_;
   bool     closed_;
   bool     stroked_;
   bool     filled_;
   double   currentX_, currentY_;
   bool     currentSet_;
   CBBox2D  bbox_;
+  Cache       *record_    { nullptr };
+  const Cache *replay_    { nullptr };
+  size_t       replayPos_ { 0 };
+};
+
+// geometry of each fill/stroke of a path action, path geometry does not depend on
+// the state so it is recorded once and replayed for each expand/exec
+struct CContextFreePathCache {
+  struct Draw {
+    uint    verb1, num_verbs;
+    uint    coord1, num_coords;
+    CBBox2D bbox; // untransformed
+  };
+
+  using Draws = std::vector<Draw>;
+
+  CContextFreePath::Verbs  verbs;
+  CContextFreePath::Coords coords;
+  Draws                    draws;
+  bool                     valid { false };
 };
 
 #endif
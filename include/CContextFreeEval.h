@@ -5,6 +5,7 @@
 
 #include <CRefPtr.h>
 #include <deque>
+#include <cstdint>
 
 class CStrParse;
 
@@ -121,6 +122,10 @@ class CEval {
 
   bool eval(const std::string &str, double *result);
 
+  // rand_static values are the n'th and following values of a seeded stream
+  void setRandStream(uint64_t seed, uint64_t n) { randSeed_ = seed; randCount_ = n; }
+  uint64_t getRandCount() const { return randCount_; }
+
  protected:
   CEval(const CEval &eval);
 
@@ -163,6 +168,8 @@ class CEval {
   bool       force_real_ { false };
   bool       degrees_    { false };
   bool       debug_      { false };
+  uint64_t   randSeed_   { 0 };
+  uint64_t   randCount_  { 0 };
 };
 
 #endif
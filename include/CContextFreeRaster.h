@@ -0,0 +1,252 @@
+#ifndef CCONTEXT_FREE_RASTER_H
+#define CCONTEXT_FREE_RASTER_H
+
+#include <CContextFree.h>
+#include <CRGBA.h>
+
+// headless renderer drawing into an in-memory RGBA8 image (premultiplied alpha, bytes
+// in r, g, b, a order, row 0 at top).
+//
+// Each shape is flattened to polygons in image coords which are scan converted into a
+// coverage accumulation buffer (exact area anti-aliasing, signed area per pixel summed
+// along each scanline) and then blended into the image a span at a time. Shapes are
+// always rasterized per fixed screen tile so the pixels do not depend on how tiles are
+// shared between threads. Tiny primitives are instead blitted from cached coverage
+// masks. All work buffers are members reused between shapes so drawing does no heap
+// allocation once they have grown.
+class CContextFreeRaster : public CContextFree {
+ public:
+  CContextFreeRaster(int w=0, int h=0);
+
+  // threads used by render (1 = draw each shape as it is passed, 0 = all cores). With
+  // more than one thread the shapes are recorded (record and pixel rect), binned into
+  // screen tiles and the tiles are drawn in parallel (each in paint order so the image
+  // is the same) building each shape polygon again per tile
+  void setRenderThreads(uint num_threads) { renderThreads_ = num_threads; }
+  uint getRenderThreads() const;
+
+  // squares, circles and triangles up to this size (pixels, at most 16) drawn with a
+  // rotation, uniform scale and flip are blitted from cached coverage masks quantized
+  // by size, rotation and sub pixel offset (0 = always scan convert)
+  void setMaxMaskSize(double size) { maxMaskSize_ = std::min(std::max(size, 0.0), 16.0); }
+  double getMaxMaskSize() const { return maxMaskSize_; }
+
+  void setSize(int w, int h);
+
+  int getWidth () const { return w_; }
+  int getHeight() const { return h_; }
+
+  // w*h pixels
+  const uint32_t *getData() const { return data_.data(); }
+
+  // unpremultiplied pixel color
+  CRGBA getPixel(int x, int y) const;
+
+  // design to image transform
+  void setMatrix(const CMatrix2D &m) { m_ = m; }
+  const CMatrix2D &getMatrix() const { return m_; }
+
+  // map view (design coords) to image, centered keeping aspect with y up
+  void setView(const CBBox2D &view);
+
+  // map tile or bbox (with border percent) to image, call after expand
+  void fitView(int border=0);
+
+  void render() override;
+
+  void render(const CBBox2D &view) override;
+
+  void fillBackground(const CHSVA &hsva) override;
+
+  void renderBatch(const ShapeRecord *shapes, uint n, const CMatrix2D &m) override;
+
+  void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
+                    const CHSVA &color) override;
+  void fillCircle  (double x, double y, double r, const CMatrix2D &m,
+                    const CHSVA &color) override;
+  void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+                    const CMatrix2D &m, const CHSVA &color) override;
+
+  void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
+                    uint32_t rgba) override;
+  void fillCircle  (double x, double y, double r, const CMatrix2D &m, uint32_t rgba) override;
+  void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+                    const CMatrix2D &m, uint32_t rgba) override;
+
+  void pathInit   () override;
+  void pathTerm   () override;
+  void pathMoveTo (double x, double y) override;
+  void pathLineTo (double x, double y) override;
+  void pathCurveTo(double x2, double y2, double x3, double y3, double x4, double y4) override;
+  void pathClose  () override;
+  void pathStroke (const CHSVA &color, const CMatrix2D &m, double w) override;
+  void pathFill   (const CHSVA &color, const CMatrix2D &m) override;
+
+ private:
+  struct Point {
+    double x { 0.0 };
+    double y { 0.0 };
+
+    Point() { }
+
+    Point(double x, double y) : x(x), y(y) { }
+  };
+
+  // polygon of Raster points (start, n), sign makes stroke pieces all add coverage
+  struct Contour {
+    uint  start { 0 };
+    uint  n     { 0 };
+    float sign  { 1.0f };
+  };
+
+  // flattened sub path of Raster polyPoints
+  struct Poly {
+    uint start  { 0 };
+    uint n      { 0 };
+    bool closed { false };
+  };
+
+  // premultiplied color (0-255) for span blend
+  struct Color {
+    alignas(16) float v[4];
+    float    alpha  { 0.0f };
+    uint32_t pixel  { 0 };
+    bool     opaque { false };
+  };
+
+  using Floats   = std::vector<float>;
+  using Points   = std::vector<Point>;
+  using Contours = std::vector<Contour>;
+  using Polys    = std::vector<Poly>;
+
+  // shape to draw: buffered primitive record (drawn with batch matrix index) or fill
+  // (index), coverage mask offset and pixel rect (clipped to image, whole mask rect for
+  // a masked shape). Polygons are built again when drawn so recording keeps only these
+  struct Shape {
+    const ShapeRecord *record { nullptr };
+    uint               index  { 0 };
+    int                mask   { -1 };
+    int                x1 { 0 }, y1 { 0 }, x2 { 0 }, y2 { 0 };
+  };
+
+  // path (verbs and coords) or primitive (params in coords) with its own transform and
+  // color, stroke width is 0 for fill
+  struct Fill {
+    ShapeKind kind      { PATH_SHAPE };
+    uint      num_verbs { 0 };
+    size_t    verb      { 0 };
+    size_t    coord     { 0 };
+    double    w         { 0.0 };
+    CMatrix2D m;
+    Color     color;
+  };
+
+  // shape polygon (image coords) and tile rasterization buffers (one per thread), acc
+  // is kept zeroed
+  struct Raster {
+    Points   points;
+    Contours contours;
+    Points   polyPoints;
+    Polys    polys;
+    Floats   acc;
+    Floats   cov;
+    uint     bw { 0 };
+  };
+
+  using Shapes   = std::vector<Shape>;
+  using Fills    = std::vector<Fill>;
+  using Matrices = std::vector<CMatrix2D>;
+  using Pixels   = std::vector<uint32_t>;
+  using Indices  = std::vector<uint>;
+  using Starts   = std::vector<size_t>;
+  using Offsets  = std::vector<int>;
+
+  static void makeColor(const CHSVA &hsva, Color &color);
+  static void makeColor(uint32_t rgba, Color &color);
+
+  static double matrixScale(const CMatrix2D &m);
+
+  static void addContour(Raster &raster, const Point *points, uint n, bool positive);
+
+  static void addSquare  (Raster &raster, double x1, double y1, double x2, double y2,
+                          const CMatrix2D &m);
+  static void addCircle  (Raster &raster, double x, double y, double r, const CMatrix2D &m);
+  static void addTriangle(Raster &raster, double x1, double y1, double x2, double y2,
+                          double x3, double y3, const CMatrix2D &m);
+
+  void addFill(ShapeKind kind, const double *coords, uint num_coords, const CMatrix2D &m,
+               double w, const Color &color);
+
+  CMatrix2D shapeMatrix(const Shape &shape) const;
+
+  void shapeColor(const Shape &shape, Color &color) const;
+
+  void buildShape(const Shape &shape, Raster &raster) const;
+
+  void buildPath(const Fill &fill, Raster &raster) const;
+
+  bool fillShape(Shape &shape);
+
+  void drawShape(const Shape &shape);
+
+  void tileRange(const Shape &shape, int &tx1, int &ty1, int &tx2, int &ty2) const;
+
+  bool fillMask(Shape &shape);
+
+  int getMask(ShapeKind kind, int size, int rotate, int ox, int oy);
+
+  void rasterizeTile(const Shape &shape, const Color &color, int tx, int ty, Raster &raster);
+
+  static void sumRow(Raster &raster, uint y, uint n, float *cov);
+
+  static void addLine(Raster &raster, float x0, float y0, float x1, float y1,
+                      float d, float w, float h);
+
+  static void addClippedLine(Raster &raster, float x0, float y0, float x1, float y1, float d);
+
+  void startRecord();
+
+  void drawRecorded();
+
+  static void blendSpan(uint32_t *dst, const float *cov, uint n, const Color &color);
+
+  void flattenPath(const Fill &fill, double tol, Raster &raster) const;
+
+  static void addStrokeJoin(Raster &raster, const Point &p, const Point &d0, const Point &d1,
+                            double hw, const CMatrix2D &m);
+
+ private:
+  int       w_ { 0 };
+  int       h_ { 0 };
+  Pixels    data_;
+  CMatrix2D m_;
+
+  uint      renderThreads_ { 1 };
+
+  // current (or recorded) shapes, batch matrices (view times batch transform) and fills
+  bool                     recording_ { false };
+  Shapes                   shapes_;
+  Matrices                 matrices_;
+  Fills                    fills_;
+  CContextFreePath::Verbs  fillVerbs_;
+  CContextFreePath::Coords fillCoords_;
+
+  // recorded shapes of each tile in paint order
+  Starts  tileStart_;
+  Indices tileShapes_;
+
+  Raster raster_;
+
+  // coverage masks of small shapes, offset in maskData_ of each (by kind, size, rotation
+  // and sub pixel offset, -1 not built, -2 no space) and half size (by kind and size)
+  double  maxMaskSize_ { 4.0 };
+  Offsets maskOffsets_;
+  Offsets maskHalf_;
+  Floats  maskData_;
+
+  // current path commands (design coords)
+  CContextFreePath::Verbs  pathVerbs_;
+  CContextFreePath::Coords pathCoords_;
+};
+
+#endif
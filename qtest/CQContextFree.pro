@@ -37,3 +37,4 @@ unix:LIBS += \
 -lCMath \
 -lCOS \
 -lCStrUtil \
+-lpthread \
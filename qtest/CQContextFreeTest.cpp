@@ -24,6 +24,11 @@ main(int argc, char **argv)
   int    max_shapes = 500000;
   int    border     = 0;
   bool   anti_alias = true;
+  int    threads    = 1;
+
+  CContextFree::ExpandMode expand_mode = CContextFree::BREADTH_FIRST_EXPAND;
+
+  std::string variation;
 
   std::vector<std::string> filenames;
 
@@ -51,6 +56,18 @@ main(int argc, char **argv)
       else if (strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "-min_size") == 0) {
         ++i; if (i < argc) min_size = atof(argv[i]);
       }
+      else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "-threads") == 0) {
+        ++i; if (i < argc) threads = atoi(argv[i]);
+      }
+      else if (strcmp(argv[i], "-dfs") == 0 || strcmp(argv[i], "-depth_first") == 0)
+        expand_mode = CContextFree::DEPTH_FIRST_EXPAND;
+      else if (strcmp(argv[i], "-hybrid") == 0)
+        expand_mode = CContextFree::HYBRID_EXPAND;
+      else if (strcmp(argv[i], "-priority") == 0)
+        expand_mode = CContextFree::PRIORITY_EXPAND;
+      else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "-variation") == 0) {
+        ++i; if (i < argc) variation = argv[i];
+      }
       else {
         cerr << "Invalid option " << argv[i] << endl;
       }
@@ -64,10 +81,15 @@ main(int argc, char **argv)
   for (uint i = 0; i < num_files; ++i)
     c->addFile(filenames[i]);
 
-  c->setMaxShapes(max_shapes);
-  c->setMinSize  (min_size);
-  c->setBorder   (border);
-  c->setAntiAlias(anti_alias);
+  c->setMaxShapes (max_shapes);
+  c->setMinSize   (min_size);
+  c->setNumThreads(threads);
+  c->setExpandMode(expand_mode);
+  c->setBorder    (border);
+  c->setAntiAlias (anti_alias);
+
+  if (variation != "")
+    c->setVariation(variation);
 
   c->resize(width, height);
 
@@ -153,6 +175,27 @@ setMaxShapes(uint max_shapes)
   c_->setMaxShapes(max_shapes);
 }
 
+void
+CQContextFreeTest::
+setNumThreads(uint num_threads)
+{
+  c_->setNumThreads(num_threads);
+}
+
+void
+CQContextFreeTest::
+setExpandMode(CContextFree::ExpandMode mode)
+{
+  c_->setExpandMode(mode);
+}
+
+void
+CQContextFreeTest::
+setVariation(const std::string &variation)
+{
+  c_->setVariation(variation);
+}
+
 void
 CQContextFreeTest::
 setBorder(int border)
@@ -221,7 +264,12 @@ resizeEvent(QResizeEvent *)
 
     progress_->show();
 
-    c_->expand();
+    // expand in time slices so events (Escape) are handled even for large generations
+    while (! c_->expandFor(std::chrono::milliseconds(100))) {
+      tick();
+
+      if (c_->getQuit()) break;
+    }
 
     progress_->hide();
 
@@ -293,7 +341,7 @@ mouseReleaseEvent(QMouseEvent *e)
 
   setViewTransform();
 
-  c_->render();
+  c_->render(CBBox2D(xmin_, ymin_, xmax_, ymax_));
 
   update();
 }
@@ -380,6 +428,28 @@ fillBackground(const CHSVA &hsv)
 void
 CQContextFree::
 fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const CHSVA &color)
+{
+  fillSquare(x1, y1, x2, y2, m, toRGBA(color));
+}
+
+void
+CQContextFree::
+fillCircle(double x, double y, double r, const CMatrix2D &m, const CHSVA &color)
+{
+  fillCircle(x, y, r, m, toRGBA(color));
+}
+
+void
+CQContextFree::
+fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+             const CMatrix2D &m, const CHSVA &color)
+{
+  fillTriangle(x1, y1, x2, y2, x3, y3, m, toRGBA(color));
+}
+
+void
+CQContextFree::
+fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, uint32_t rgba)
 {
   QPainterPath path;
 
@@ -390,7 +460,7 @@ fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const
 
   path.closeSubpath();
 
-  QColor c = getColor(color);
+  QColor c = getColor(rgba);
 
   QPainter *ipainter = c_->getIPainter();
 
@@ -406,13 +476,13 @@ fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const
 
 void
 CQContextFree::
-fillCircle(double x, double y, double r, const CMatrix2D &m, const CHSVA &color)
+fillCircle(double x, double y, double r, const CMatrix2D &m, uint32_t rgba)
 {
   QPainterPath path;
 
   path.addEllipse(QRectF(x - r, y - r, 2*r, 2*r));
 
-  QColor c = getColor(color);
+  QColor c = getColor(rgba);
 
   QPainter *ipainter = c_->getIPainter();
 
@@ -429,7 +499,7 @@ fillCircle(double x, double y, double r, const CMatrix2D &m, const CHSVA &color)
 void
 CQContextFree::
 fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
-             const CMatrix2D &m, const CHSVA &color)
+             const CMatrix2D &m, uint32_t rgba)
 {
   QPainterPath path;
 
@@ -439,7 +509,7 @@ fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
 
   path.closeSubpath();
 
-  QColor c = getColor(color);
+  QColor c = getColor(rgba);
 
   QPainter *ipainter = c_->getIPainter();
 
@@ -557,6 +627,24 @@ getColor(const CHSVA &hsv)
   return c;
 }
 
+QColor
+CQContextFree::
+getColor(uint32_t rgba)
+{
+  return QColor(int((rgba      ) & 0xff), int((rgba >>  8) & 0xff),
+                int((rgba >> 16) & 0xff), int((rgba >> 24) & 0xff));
+}
+
+uint32_t
+CQContextFree::
+toRGBA(const CHSVA &hsv)
+{
+  auto rgba = CRGBUtil::HSVAtoRGBA(hsv);
+
+  return (uint32_t(rgba.getRedI ())      ) | (uint32_t(rgba.getGreenI()) <<  8) |
+         (uint32_t(rgba.getBlueI()) << 16) | (uint32_t(rgba.getAlphaI()) << 24);
+}
+
 QTransform
 CQContextFree::
 toQTransform(const CMatrix2D &m)
@@ -23,6 +23,12 @@ class CQContextFree : public CContextFree {
   void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
                     const CMatrix2D &m, const CHSVA &color);
 
+  void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
+                    uint32_t rgba);
+  void fillCircle  (double x, double y, double r, const CMatrix2D &m, uint32_t rgba);
+  void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+                    const CMatrix2D &m, uint32_t rgba);
+
   void pathInit   ();
   void pathTerm   ();
   void pathMoveTo (double x, double y);
@@ -33,6 +39,9 @@ class CQContextFree : public CContextFree {
   void pathFill   (const CHSVA &color, const CMatrix2D &m);
 
   static QColor getColor(const CHSVA &hsv);
+  static QColor getColor(uint32_t rgba);
+
+  static uint32_t toRGBA(const CHSVA &hsv);
 
   QTransform toQTransform(const CMatrix2D &m);
 
@@ -62,6 +71,9 @@ class CQContextFreeTest : public QWidget {
 
   void setMaxShapes(uint max_shapes);
   void setMinSize  (double min_size);
+  void setNumThreads(uint num_threads);
+  void setExpandMode(CContextFree::ExpandMode mode);
+  void setVariation(const std::string &variation);
   void setBorder   (int border);
   void setAntiAlias(bool anti_alias);
 
@@ -5,7 +5,18 @@
 #include <CArcToBezier.h>
 #include <C3Bezier2D.h>
 #include <CStrParse.h>
+#include <CRGBUtil.h>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 class CContextFreeParse : public CStrParse {
  public:
@@ -25,14 +36,163 @@ class CContextFreeParse : public CStrParse {
   CFile        *file_ { nullptr };
 };
 
-class CContextFreeCmp {
+// heap order for priority expansion (largest rule at top)
+class CContextFreeSizeCmp {
+ public:
+  CContextFreeSizeCmp() {
+  }
+
+  bool operator()(const CContextFree::RuleState &rule1, const CContextFree::RuleState &rule2) {
+    return (rule1.getArea() < rule2.getArea());
+  }
+};
+
+//------
+
+// per thread output of a parallel expansion chunk (child rules, shapes, bbox and shape count)
+struct CContextFree::ExpandBuffer {
+  RuleStateStack   ruleStack;
+  ShapeBuffer      shapeBuffer;
+  CBBox2D          bbox;
+  uint             num_shapes  { 0 };
+  uint             num_chained { 0 };
+  CContextFreePath path;
+  bool             done       { false };
+};
+
+thread_local CContextFree::ExpandBuffer *CContextFree::expandBuffer_ = nullptr;
+
+// bounded single producer (expansion) single consumer (render) lock free queue
+// of finalized shapes used by expandAndRender. An empty (or full) queue is waited on
+// by spinning briefly and then blocking until the other side signals.
+class CContextFree::StreamQueue {
  public:
-  CContextFreeCmp() {
+  // packed shape or path rule state
+  struct Shape {
+    ShapeRecord  record;
+    Rule        *rule { nullptr };
+    State        state;
+  };
+
+ public:
+  StreamQueue(uint size) :
+   shapes_(size), mask_(size - 1) {
+    assert((size & mask_) == 0);
+  }
+
+  void push(const ShapeRecord &record) {
+    Shape &shape = allocShape();
+
+    shape.record = record;
+    shape.rule   = nullptr;
+
+    pushShape();
+  }
+
+  void push(Rule *rule, const State &state) {
+    Shape &shape = allocShape();
+
+    shape.rule  = rule;
+    shape.state = state;
+
+    pushShape();
+  }
+
+  // returns false when queue is closed and empty
+  bool pop(Shape &shape) {
+    size_t head = head_.load(std::memory_order_relaxed);
+
+    if (head == tail_.load(std::memory_order_acquire)) {
+      wait(popWaiting_, notEmpty_, [&]() {
+        return (head != tail_.load(std::memory_order_acquire) ||
+                closed_.load(std::memory_order_acquire));
+      });
+
+      if (head == tail_.load(std::memory_order_acquire))
+        return false;
+    }
+
+    shape = shapes_[head & mask_];
+
+    head_.store(head + 1, std::memory_order_release);
+
+    wake(pushWaiting_, notFull_);
+
+    return true;
+  }
+
+  void close() {
+    closed_.store(true, std::memory_order_release);
+
+    wake(popWaiting_, notEmpty_);
+  }
+
+ private:
+  Shape &allocShape() {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+
+    if (tail - head_.load(std::memory_order_acquire) > mask_)
+      wait(pushWaiting_, notFull_, [&]() {
+        return (tail - head_.load(std::memory_order_acquire) <= mask_);
+      });
+
+    return shapes_[tail & mask_];
+  }
+
+  void pushShape() {
+    tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+
+    wake(popWaiting_, notEmpty_);
+  }
+
+  // spin then sleep until ready (waiting flag and fences make sure a wake after the
+  // other side changes the queue can't be missed)
+  template<typename READY>
+  void wait(std::atomic<bool> &waiting, std::condition_variable &cond, READY ready) {
+    for (uint i = 0; i < spin_count; ++i) {
+      if (ready()) return;
+
+      std::this_thread::yield();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    waiting.store(true, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    cond.wait(lock, ready);
+
+    waiting.store(false, std::memory_order_relaxed);
   }
 
-  int operator()(const CContextFree::RuleState &rule1, const CContextFree::RuleState &rule2) {
-    return (rule1.getArea() > rule2.getArea());
+  void wake(std::atomic<bool> &waiting, std::condition_variable &cond) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (! waiting.load(std::memory_order_relaxed)) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    cond.notify_one();
   }
+
+ private:
+  using Shapes = std::vector<Shape>;
+
+  Shapes              shapes_;
+  size_t              mask_   { 0 };
+  std::atomic<size_t> head_   { 0 };
+  std::atomic<size_t> tail_   { 0 };
+  std::atomic<bool>   closed_ { false };
+
+  // blocking wait (after spin_count tries) for empty (pop) or full (push) queue
+  static const uint spin_count = 64;
+
+  std::mutex              mutex_;
+  std::condition_variable notEmpty_;
+  std::condition_variable notFull_;
+  std::atomic<bool>       popWaiting_  { false };
+  std::atomic<bool>       pushWaiting_ { false };
 };
 
 //------
@@ -63,16 +223,28 @@ reset()
 
   tile_.reset();
 
+  strokeMargin_ = 0.0;
+
   for (auto &rule : rules_)
     delete rule.second;
 
   rules_.clear();
 
-  ruleStack_.clear();
+  code_.clear();
+
+  ruleStack_.release();
+  genStack_ .release();
+
+  expanding_  = false;
+  expandDone_ = false;
 
   includes_.clear();
 
-  zRuleStack_.clear();
+  shapeBuffer_.release();
+
+  shapesSorted_ = true;
+
+  spatialIndex_.reset();
 
   delete path_;
 
@@ -89,6 +261,13 @@ parse(const std::string &filename)
 {
   start_shape_ = "";
 
+  expandDone_ = false;
+
+  // rand_static stream seeded from seed (or variation) so it changes with it like rule
+  // choices do (random from time if not set)
+  randStaticSeed_  = Rand::mix(~(seedSet_ ? seed_ : Rand::mix(uint64_t(time(nullptr)))));
+  randStaticCount_ = 0;
+
   if (! parseFile(filename))
     return false;
 
@@ -178,7 +357,45 @@ void
 CContextFree::
 expand()
 {
-  srand(uint(time(nullptr)));
+  if (! startExpand())
+    return;
+
+  expandRules(0, nullptr);
+
+  //std::cerr << getNumShapes() << "\n";
+  //std::cerr << bbox_ << "\n";
+}
+
+bool
+CContextFree::
+expandSteps(uint n)
+{
+  if (! expanding_ && (expandDone_ || ! startExpand()))
+    return true;
+
+  return expandRules(std::max(n, 1U), nullptr);
+}
+
+bool
+CContextFree::
+expandUntil(const TimePoint &end_time)
+{
+  if (! expanding_ && (expandDone_ || ! startExpand()))
+    return true;
+
+  return expandRules(0, &end_time);
+}
+
+bool
+CContextFree::
+startExpand()
+{
+  finishExpand();
+
+  expandDone_ = false;
+
+  if (! seedSet_)
+    seed_ = Rand::mix(uint64_t(time(nullptr)));
 
   num_shapes_ = 0;
 
@@ -188,252 +405,1638 @@ expand()
 
   if (rule == nullptr) {
     error("No start shape : " + name);
-    return;
+    return false;
   }
 
-  zRuleStack_.clear();
+  resolveRules();
 
-  RuleStateStack ruleStack;
+  compileRules();
 
-  ruleStack_.clear();
+  if (clip_.isSet())
+    calcRuleBounds();
 
-  pushRule(rule, State());
+  expandStats_.reset();
 
-  while (! ruleStack_.empty()) {
-    std::swap(ruleStack, ruleStack_);
+  shapeBuffer_.release();
 
-    ruleStack_.clear();
+  shapesSorted_ = true;
 
-    uint n = uint(ruleStack.size());
+  spatialIndex_.reset();
 
-    for (uint i = 0; i < n; ++i) {
-      RuleState &ruleState = ruleStack[i];
+  State state;
 
-      ruleState.expand();
-    }
+  state.seed = seed_;
 
-    if (! tick()) break;
-  }
+  pushRule(rule, state);
 
-  //std::cerr << getNumShapes() << "\n";
-  //std::cerr << bbox_ << "\n";
+  expanding_ = true;
+
+  return true;
 }
 
 void
 CContextFree::
-updateBBox(const CBBox2D &bbox)
+finishExpand()
 {
-  bbox_.add(bbox);
+  boundShapes();
+
+  expanding_ = false;
+
+  genStack_ .release();
+  ruleStack_.release();
+
+  genPos_     = 0;
+  genStarted_ = false;
 }
 
-void
+bool
 CContextFree::
-render()
+expandRules(uint max_rules, const TimePoint *end_time)
 {
-  adjustMatrix_.setIdentity();
+  // expand pending rules until done or the rule count/time budget is used up, the
+  // current generation (genStack_, genPos_) and ruleStack_ are kept so a later call
+  // continues from the same point
+  static const uint tick_interval     = 4096;
+  static const uint parallel_slice    = 1024;
+  static const uint min_parallel_rules = 256;
 
-  fillBackground(bg_);
+  uint num_rules = 0;
+  uint num_ticks = 0;
 
-  double xmin, ymin, xmax, ymax;
+  uint num_threads = getNumThreads();
 
-  if (getTile(&xmin, &ymin, &xmax, &ymax)) {
-    double w = fabs(xmax - xmin);
-    double h = fabs(ymax - ymin);
+  while (true) {
+    // current generation done (depth first and priority also need an empty stack)
+    if (genPos_ >= genStack_.size() && (genMode_ == BREADTH_FIRST_EXPAND || ruleStack_.empty())) {
+      if (genStarted_) {
+        genStarted_ = false;
 
-    int nl = 0; while (xmin > bbox_.getXMin()) { xmin -= w; ++nl; }
-    int nr = 0; while (xmax < bbox_.getXMax()) { xmax += w; ++nr; }
-    int nb = 0; while (ymin > bbox_.getYMin()) { ymin -= h; ++nb; }
-    int nt = 0; while (ymax < bbox_.getYMax()) { ymax += h; ++nt; }
+        // current and next generation are both held at end of generation
+        expandStats_.peak_frontier =
+          std::max(expandStats_.peak_frontier, uint(genStack_.size() + ruleStack_.size()));
 
-    int nx = nl + nr + 1;
-    int ny = nb + nt + 1;
+        boundShapes();
 
-    for (int iy = 0; iy < ny; ++iy) {
-      double y = -(iy - nb)*h;
+        if (! tick()) break;
+      }
 
-      for (int ix = 0; ix < nx; ++ix) {
-        double x = -(ix - nl)*w;
+      if (ruleStack_.empty()) break;
 
-        renderAt(x, y);
-      }
+      startGeneration();
+    }
+
+    if (max_rules > 0 && num_rules >= max_rules) {
+      boundShapes();
+      return false;
+    }
+
+    if (end_time && std::chrono::steady_clock::now() >= *end_time) {
+      boundShapes();
+      return false;
     }
-  }
-  else {
-    for (auto &zRuleStack : zRuleStack_) {
-      RuleStateStack &ruleStack = zRuleStack.second;
 
-      std::sort(ruleStack.begin(), ruleStack.end(), CContextFreeCmp());
+    //---
 
-      uint num = uint(ruleStack.size());
+    if      (genMode_ == BREADTH_FIRST_EXPAND) {
+      uint n = uint(genStack_.size()) - genPos_;
 
-      for (uint i = 0; i < num; ++i) {
-        RuleState &ruleState = ruleStack[i];
+      if (num_threads > 1 && n >= min_parallel_rules) {
+        // limit work between budget checks
+        if (end_time)
+          n = std::min(n, num_threads*parallel_slice);
 
-        ruleState.exec();
+        if (max_rules > 0)
+          n = std::min(n, max_rules - num_rules);
       }
+      else
+        n = 1;
+
+      // rules left after the shape limit is hit add nothing so are not counted
+      uint num_expanded = 0;
+
+      if      (n > 1)
+        num_expanded = expandParallel(genStack_, genPos_, genPos_ + n);
+      else if (! checkMaxShapes()) {
+        genStack_[genPos_].expand();
+
+        num_expanded = 1;
+      }
+
+      genPos_    += n;
+      num_rules  += n;
+      num_ticks  += n;
+
+      expandStats_.num_expanded += num_expanded;
     }
-  }
-}
+    else {
+      if (genMode_ == DEPTH_FIRST_EXPAND) {
+        if (ruleStack_.empty())
+          ruleStack_.push_back(genStack_[genPos_++]);
 
-void
-CContextFree::
-renderAt(double x, double y)
-{
-  adjustMatrix_ = CMatrix2D::translation(x, y);
+        expandDepthFirst();
+      }
+      else {
+        if (checkMaxShapes())
+          ruleStack_.clear();
+        else
+          expandPriority();
+      }
 
-  for (auto &zRuleStack : zRuleStack_) {
-    RuleStateStack &ruleStack = zRuleStack.second;
+      ++num_rules;
 
-    uint num = uint(ruleStack.size());
+      ++expandStats_.num_expanded;
 
-    for (uint i = 0; i < num; ++i) {
-      RuleState &ruleState = ruleStack[i];
+      // depth first and priority have no generations so tick at regular intervals
+      if (++num_ticks >= tick_interval) {
+        num_ticks = 0;
 
-      ruleState.exec();
+        boundShapes();
+
+        if (! tick()) break;
+      }
     }
   }
-}
-
-bool
-CContextFree::
-parseComment1()
-{
-  parse_->skipChars(2);
 
-  while (! parse_->eof() && (! parse_->isChar('*') || ! parse_->isNextChar('/')))
-    parse_->skipChar();
+  finishExpand();
 
-  parse_->skipChars(2);
+  expandDone_ = true;
 
   return true;
 }
 
-bool
+void
 CContextFree::
-parseComment2()
+startGeneration()
 {
-  parse_->skipChars(2);
+  std::swap(genStack_, ruleStack_);
 
-  while (! parse_->eol())
-    parse_->skipChar();
+  ruleStack_.clear();
 
-  return true;
-}
+  genPos_     = 0;
+  genStarted_ = true;
 
-bool
-CContextFree::
-parseComment3()
-{
-  parse_->skipChar();
+  ++expandStats_.num_generations;
 
-  while (! parse_->eol())
-    parse_->skipChar();
+  if      (expandMode_ == PRIORITY_EXPAND) {
+    genMode_ = PRIORITY_EXPAND;
 
-  return true;
+    for (auto &ruleState : genStack_)
+      pushRule(ruleState.getRule(), ruleState.getState());
+
+    genPos_ = uint(genStack_.size());
+  }
+  else if (expandMode_ == DEPTH_FIRST_EXPAND ||
+           (expandMode_ == HYBRID_EXPAND && genStack_.size() > max_frontier_))
+    genMode_ = DEPTH_FIRST_EXPAND;
+  else
+    genMode_ = BREADTH_FIRST_EXPAND;
 }
 
-bool
+void
 CContextFree::
-parseStartShape()
+expandDepthFirst()
 {
-  // start_shape <user_string>
-  if (! parse_->isIdentifier())
-    return false;
+  // fully expand each rule of the generation in turn using ruleStack_ as an explicit
+  // stack so the number of pending rules is bounded by depth times branching
+  RuleState ruleState = ruleStack_.back();
 
-  std::string id;
+  ruleStack_.pop_back();
 
-  if (! parseName(id)) return false;
+  uint pos = uint(ruleStack_.size());
 
-  setStartShape(id);
+  ruleState.expand();
 
-  return true;
+  // reverse children so they are popped in action order
+  std::reverse(ruleStack_.begin() + pos, ruleStack_.end());
+
+  expandStats_.peak_frontier =
+    std::max(expandStats_.peak_frontier, uint(genStack_.size() - genPos_ + ruleStack_.size()));
 }
 
-bool
+void
 CContextFree::
-parseInclude()
+expandPriority()
 {
-  // include <user_string>
-  // include <user_filename>
-  std::string filename;
+  // ruleStack_ is kept as a heap on rule size (see pushRule) so the largest pending
+  // rule is always expanded next and the max shapes budget goes on the biggest shapes
+  std::pop_heap(ruleStack_.begin(), ruleStack_.end(), CContextFreeSizeCmp());
 
-  if (parse_->isChar('"')) {
-    if (! parse_->readString(filename))
-      return false;
-  }
-  else {
-    if (! parse_->readNonSpace(filename))
-      return false;
-  }
+  RuleState ruleState = ruleStack_.back();
 
-  includes_.push_back(filename);
+  ruleStack_.pop_back();
 
-  skipSpace();
+  ruleState.expand();
 
-  return true;
+  expandStats_.peak_frontier = std::max(expandStats_.peak_frontier, uint(ruleStack_.size()));
 }
 
-bool
+uint
 CContextFree::
-parseBackground()
+expandParallel(RuleStateStack &ruleStack, uint i1, uint i2)
 {
-  // background { <color_adjustments> }
-  if (! parse_->isChar('{') && ! parse_->isChar('['))
-    return false;
+  // split rules into chunks which idle threads take in turn, each chunk writes
+  // to its own buffer and the buffers are merged in chunk order so the resulting
+  // rule and shape stacks are the same as for a serial expansion. Returns number of
+  // rules in merged or re-expanded chunks (discarded chunks don't count)
+  static const uint min_chunk_size = 32;
 
-  char end_char = (parse_->isChar('{') ? '}' : ']');
+  uint num_threads = getNumThreads();
 
-  parse_->skipChar();
+  uint n = i2 - i1;
 
-  skipSpace();
+  uint chunk_size = std::max(min_chunk_size, n/(8*num_threads));
+  uint num_chunks = (n + chunk_size - 1)/chunk_size;
 
-  double hue = 0.0, saturation = 0.0, brightness = 0.0, alpha = 0.0;
+  std::vector<ExpandBuffer> buffers(num_chunks);
 
-  while (! parse_->eof() && ! parse_->isChar(end_char)) {
-    std::string name;
+  std::atomic<uint> next_chunk { 0 };
+  std::atomic<uint> last_chunk { num_chunks };
 
-    if (! parseName(name)) return false;
+  auto expandChunk = [&](uint k) {
+    uint j1 = i1 + k*chunk_size;
+    uint j2 = std::min(j1 + chunk_size, i2);
 
-    if      (name == "hue" || name == "h") {
-      if (! parseReal(&hue)) hue = 0.0;
+    for (uint j = j1; j < j2; ++j)
+      ruleStack[j].expand();
+  };
 
-      while (hue <    0.0) hue += 360.0;
-      while (hue >= 360.0) hue -= 360.0;
-    }
-    else if (name == "saturation" || name == "sat") {
-      if (! parseReal(&saturation)) saturation = 1.0;
+  auto expandChunks = [&]() {
+    while (true) {
+      uint k = next_chunk++;
 
-      saturation = std::min(std::max(saturation, -1.0), 1.0);
-    }
-    else if (name == "brightness" || name == "b") {
-      if (! parseReal(&brightness)) brightness = 1.0;
+      if (k >= num_chunks || k > last_chunk) break;
 
-      brightness = std::min(std::max(brightness, -1.0), 1.0);
-    }
-    else if (name == "alpha" || name == "a") {
-      if (! parseReal(&alpha)) alpha = 1.0;
+      ExpandBuffer &buffer = buffers[k];
 
-      alpha = std::min(std::max(alpha, -1.0), 1.0);
-    }
-    else {
-      error("Invalid background value " + name);
-    }
+      expandBuffer_ = &buffer;
 
-    skipSpace();
-  }
+      expandChunk(k);
 
-  if (! parse_->eof() && parse_->isChar(end_char)) {
-    parse_->skipChar();
+      boundShapes(buffer.shapeBuffer, buffer.bbox);
 
-    skipSpace();
-  }
+      expandBuffer_ = nullptr;
 
-  bg_ += CHSVA(hue, saturation, brightness, alpha);
+      buffer.done = true;
 
-  return true;
-}
+      // shape limit reached by this chunk so all later chunks will be discarded
+      if (checkMaxShapesBase(buffer.num_shapes)) {
+        uint k1 = last_chunk;
 
-bool
+        while (k < k1 && ! last_chunk.compare_exchange_weak(k1, k))
+          ;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+
+  for (uint i = 1; i < num_threads; ++i)
+    threads.push_back(std::thread(expandChunks));
+
+  expandChunks();
+
+  for (auto &thread : threads)
+    thread.join();
+
+  //---
+
+  uint num_shapes = num_shapes_;
+
+  uint num_expanded = 0;
+
+  for (uint k = 0; k < num_chunks; ++k) {
+    if (checkMaxShapes()) break;
+
+    ExpandBuffer &buffer = buffers[k];
+
+    // chunk was expanded with a lower shape count than the serial one so if it could
+    // have hit the shape limit (or was skipped) re-expand it with the correct count
+    if (! buffer.done || (num_shapes_ != num_shapes && checkMaxShapesBase(buffer.num_shapes)))
+      expandChunk(k);
+    else
+      mergeExpandBuffer(buffer);
+
+    num_expanded += std::min(i1 + (k + 1)*chunk_size, i2) - (i1 + k*chunk_size);
+  }
+
+  return num_expanded;
+}
+
+void
+CContextFree::
+mergeExpandBuffer(ExpandBuffer &buffer)
+{
+  // bound serial shapes first so block boundaries stay behind the merged (bounded) ones
+  boundShapes();
+
+  ruleStack_.append(buffer.ruleStack.begin(), buffer.ruleStack.end());
+
+  ShapeBuffer &shapeBuffer = buffer.shapeBuffer;
+
+  if (streamQueue_) {
+    for (const auto &shape : shapeBuffer.shapes) {
+      if (shape.getKind() == PATH_SHAPE) {
+        const RuleState &ruleState = shapeBuffer.paths[shape.color];
+
+        streamQueue_->push(ruleState.getRule(), ruleState.getState());
+      }
+      else
+        streamQueue_->push(shape);
+    }
+  }
+  else if (! shapeBuffer.shapes.empty()) {
+    // rebase path indices
+    uint32_t pathOffset = uint32_t(shapeBuffer_.paths.size());
+
+    size_t i = shapeBuffer_.shapes.size();
+
+    shapeBuffer_.shapes    .append(shapeBuffer.shapes    .begin(), shapeBuffer.shapes    .end());
+    shapeBuffer_.keys      .append(shapeBuffer.keys      .begin(), shapeBuffer.keys      .end());
+    shapeBuffer_.paths     .append(shapeBuffer.paths     .begin(), shapeBuffer.paths     .end());
+    shapeBuffer_.pathBBoxes.append(shapeBuffer.pathBBoxes.begin(), shapeBuffer.pathBBoxes.end());
+
+    if (pathOffset > 0 && ! shapeBuffer.paths.empty()) {
+      for ( ; i < shapeBuffer_.shapes.size(); ++i) {
+        ShapeRecord &shape = shapeBuffer_.shapes[i];
+
+        if (shape.getKind() == PATH_SHAPE)
+          shape.color += pathOffset;
+      }
+    }
+
+    shapeBuffer_.numBounded = shapeBuffer_.shapes.size();
+
+    shapesSorted_ = false;
+  }
+
+  if (buffer.bbox.isSet())
+    bbox_.add(buffer.bbox);
+
+  num_shapes_ += buffer.num_shapes;
+
+  expandStats_.num_chained += buffer.num_chained;
+}
+
+void
+CContextFree::
+setVariation(const std::string &variation)
+{
+  // FNV-1a hash of variation string
+  uint64_t seed = 0xcbf29ce484222325ULL;
+
+  for (auto c : variation) {
+    seed ^= uint64_t(uint8_t(c));
+    seed *= 0x100000001b3ULL;
+  }
+
+  setSeed(Rand::mix(seed));
+}
+
+void
+CContextFree::
+compileRules()
+{
+  // lower rule action lists to flat instruction array (rules with actions that
+  // can't be compiled, i.e. paths, keep using the action objects)
+  code_.clear();
+
+  for (auto &rule : rules_)
+    rule.second->compile(code_);
+
+  if (! compileRules_)
+    code_.clear();
+}
+
+void
+CContextFree::
+calcRuleBounds()
+{
+  // bounds are least fixed point of rule bound from child bounds iterated from zero.
+  // Slowly converging (scaled recursive) rules are widened and then checked to be no
+  // less than the bound from their children which makes them safe, any rule which
+  // fails is unbounded (never clipped)
+  static const int    max_passes = 64;
+  static const double widen[]    = { 1.001, 1.01, 1.1, 2.0, 16.0 };
+
+  for (auto &rule : rules_)
+    rule.second->setBound(0.0);
+
+  for (int pass = 0; pass < max_passes; ++pass) {
+    bool changed = false;
+
+    for (auto &rule : rules_) {
+      double r = rule.second->calcBound();
+
+      if (r > rule.second->getBound()) {
+        rule.second->setBound(r);
+
+        changed = true;
+      }
+    }
+
+    if (! changed) return;
+  }
+
+  auto checkBounds = [&]() {
+    for (auto &rule : rules_)
+      if (rule.second->calcBound() > rule.second->getBound())
+        return false;
+
+    return true;
+  };
+
+  std::vector<double> bounds;
+
+  for (auto &rule : rules_)
+    bounds.push_back(rule.second->getBound());
+
+  for (auto w : widen) {
+    size_t i = 0;
+
+    for (auto &rule : rules_)
+      rule.second->setBound(bounds[i++]*w);
+
+    if (checkBounds()) return;
+  }
+
+  bool changed = true;
+
+  while (changed) {
+    changed = false;
+
+    for (auto &rule : rules_) {
+      if (rule.second->calcBound() > rule.second->getBound()) {
+        rule.second->setBound(std::numeric_limits<double>::infinity());
+
+        changed = true;
+      }
+    }
+  }
+}
+
+bool
+CContextFree::
+estimateCost(CostEstimate &cost)
+{
+  // expected number of rule states in each generation (breadth first) using the
+  // adjustment scale bounds, rule states of the same rule and (nearly) the same scale
+  // are merged and unlikely ones dropped (ends recursion which only continues by chance)
+  static const double min_count = 1E-6;
+  static const uint   max_depth = 1<<16;
+  static const double scale_res = 4096; // scale buckets per factor of e
+
+  cost = CostEstimate();
+
+  if (getStartShape() == "") return false;
+
+  Rule *rule = getRule(getStartShape());
+
+  resolveRules();
+
+  findNonContractingCycles(rule, cost.cycles);
+
+  if (rule->isBasic()) {
+    cost.num_shapes = 1.0;
+
+    return true;
+  }
+
+  double limit = min_size_*pixelSize_;
+
+  struct Pending {
+    double s { 1.0 }; // scale
+    double n { 0.0 }; // expected count
+  };
+
+  using Generation = std::map<std::pair<Rule *, int64_t>, Pending>;
+
+  Generation gen, next;
+
+  gen[std::make_pair(rule, int64_t(0))] = Pending { 1.0, 1.0 };
+
+  double last_n = 0.0;
+
+  while (! gen.empty()) {
+    double n = 0.0;
+
+    for (const auto &g : gen)
+      n += g.second.n;
+
+    ++cost.depth;
+
+    // current and next generation are both held at end of generation (as expand)
+    cost.num_expanded += n;
+    cost.peak_frontier = std::max(cost.peak_frontier, last_n + n);
+
+    last_n = n;
+
+    next.clear();
+
+    for (const auto &g : gen) {
+      auto proc = [&](Rule *child, double s1, double p1) {
+        if (child->isBasic()) {
+          cost.num_shapes += p1;
+          return;
+        }
+
+        Pending &pending = next[std::make_pair(child, int64_t(std::llround(std::log(s1)*scale_res)))];
+
+        if (pending.n == 0.0)
+          pending.s = s1;
+
+        pending.n += p1;
+      };
+
+      g.first.first->visitChildren(g.second.s, g.second.n, limit, proc);
+    }
+
+    gen.clear();
+
+    for (const auto &g : next)
+      if (g.second.n >= min_count)
+        gen.insert(g);
+
+    if ((max_shapes_ > 0 && cost.num_shapes >= max_shapes_) ||
+        cost.depth >= max_depth || ! std::isfinite(cost.num_expanded)) {
+      cost.limited = true;
+      break;
+    }
+  }
+
+  if (max_shapes_ > 0)
+    cost.num_shapes = std::min(cost.num_shapes, double(max_shapes_));
+
+  return true;
+}
+
+void
+CContextFree::
+findNonContractingCycles(Rule *start, std::vector<std::string> &names)
+{
+  // rule graph reachable from start with largest scale of each parent to child edge
+  std::map<Rule *, uint>              index;
+  std::vector<Rule *>                 rules;
+  std::vector<std::map<uint, double>> edges;
+
+  auto addRule = [&](Rule *rule) {
+    auto p = index.find(rule);
+
+    if (p != index.end()) return (*p).second;
+
+    uint i = uint(rules.size());
+
+    index[rule] = i;
+
+    rules.push_back(rule);
+    edges.emplace_back();
+
+    return i;
+  };
+
+  addRule(start);
+
+  for (uint i = 0; i < rules.size(); ++i) {
+    auto proc = [&](Rule *child, double s1, double) {
+      if (child->isBasic()) return;
+
+      uint j = addRule(child);
+
+      double &s = edges[i][j];
+
+      s = std::max(s, s1);
+    };
+
+    rules[i]->visitChildren(1.0, 1.0, 0.0, proc);
+  }
+
+  // strongly connected components (Tarjan)
+  uint n = uint(rules.size());
+
+  std::vector<int>  order(n, -1), low(n, 0), comp(n, -1);
+  std::vector<bool> onStack(n, false);
+  std::vector<uint> stack;
+
+  int num_order = 0, num_comps = 0;
+
+  std::function<void (uint)> connect = [&](uint i) {
+    order[i] = low[i] = num_order++;
+
+    stack.push_back(i); onStack[i] = true;
+
+    for (const auto &e : edges[i]) {
+      uint j = e.first;
+
+      if      (order[j] < 0) { connect(j); low[i] = std::min(low[i], low[j]); }
+      else if (onStack[j])   { low[i] = std::min(low[i], order[j]); }
+    }
+
+    if (low[i] == order[i]) {
+      uint j;
+
+      do {
+        j = stack.back(); stack.pop_back(); onStack[j] = false;
+
+        comp[j] = num_comps;
+      } while (j != i);
+
+      ++num_comps;
+    }
+  };
+
+  for (uint i = 0; i < n; ++i)
+    if (order[i] < 0)
+      connect(i);
+
+  // component has a non-contracting cycle if longest path (log scale, slightly
+  // favoring unit scale) keeps growing after n passes of Bellman-Ford
+  for (int c = 0; c < num_comps; ++c) {
+    std::vector<uint> nodes;
+
+    for (uint i = 0; i < n; ++i)
+      if (comp[i] == c)
+        nodes.push_back(i);
+
+    std::vector<double> dist(n, -std::numeric_limits<double>::infinity());
+
+    dist[nodes[0]] = 0.0;
+
+    bool changed = true;
+
+    for (uint pass = 0; pass <= nodes.size() && changed; ++pass) {
+      changed = false;
+
+      for (auto i : nodes) {
+        if (std::isinf(dist[i])) continue;
+
+        for (const auto &e : edges[i]) {
+          if (comp[e.first] != c) continue;
+
+          double d = dist[i] + std::log(e.second) + 1E-9;
+
+          if (d > dist[e.first]) {
+            dist[e.first] = d;
+
+            changed = true;
+          }
+        }
+      }
+    }
+
+    if (changed) {
+      for (auto i : nodes)
+        names.push_back(rules[i]->getName());
+    }
+  }
+}
+
+CContextFree::Rule *
+CContextFree::
+execCode(uint pc, const State &state, State *tailState)
+{
+  // returns tail child (and its state) instead of pushing it if tailState is given
+  // current loop frames, shared by nested calls on the same thread (base marks ours)
+  struct LoopFrame {
+    State    state;
+    uint64_t seed { 0 };
+    int      i    { 0 };
+  };
+
+  static thread_local std::vector<LoopFrame> frames;
+
+  size_t base = frames.size();
+
+  const Instr *code = &code_[0];
+
+  while (true) {
+    const Instr &instr = code[pc];
+
+    const State &state1 = (frames.size() > base ? frames.back().state : state);
+
+    switch (instr.op) {
+      case PUSH_RULE_INSTR:
+      case EMIT_SHAPE_INSTR: {
+        State state2;
+
+        if (! adjustChildState(state1, *instr.adj, state2)) {
+          // too small ends simple loop
+          if (instr.loop) {
+            frames.pop_back();
+
+            pc = instr.jump;
+          }
+          else
+            ++pc;
+
+          break;
+        }
+
+        if (instr.loop)
+          state2.seed = Rand::value(frames.back().seed, uint(frames.back().i));
+        else
+          state2.seed = Rand::value(state1.seed, instr.salt);
+
+        if      (instr.op == EMIT_SHAPE_INSTR)
+          instr.rule->expand(state2);
+        else if (instr.tail && tailState) {
+          // tail is last instruction (no loop frames left)
+          if (! checkClip(instr.rule, state2)) return nullptr;
+
+          *tailState = state2;
+
+          return instr.rule;
+        }
+        else
+          pushRuleState(instr.rule, state2);
+
+        ++pc;
+
+        break;
+      }
+      case LOOP_BEGIN_INSTR: {
+        if (instr.n <= 0) {
+          pc = instr.jump;
+          break;
+        }
+
+        LoopFrame frame;
+
+        frame.state = state1;
+        frame.seed  = Rand::value(state1.seed, instr.salt);
+
+        frames.push_back(frame);
+
+        ++pc;
+
+        break;
+      }
+      case LOOP_CHECK_INSTR: {
+        LoopFrame &frame = frames.back();
+
+        if (checkSizeLimit(frame.state)) {
+          frames.pop_back();
+
+          pc = instr.jump;
+
+          break;
+        }
+
+        frame.state.seed = Rand::value(frame.seed, uint(frame.i));
+
+        ++pc;
+
+        break;
+      }
+      case LOOP_END_INSTR: {
+        LoopFrame &frame = frames.back();
+
+        if (++frame.i < instr.n) {
+          frame.state = adjustState(frame.state, *instr.adj);
+
+          pc = instr.jump;
+        }
+        else {
+          frames.pop_back();
+
+          ++pc;
+        }
+
+        break;
+      }
+      default:
+        return nullptr;
+    }
+  }
+}
+
+uint
+CContextFree::
+getNumThreads() const
+{
+  if (num_threads_ == 0)
+    return std::max(std::thread::hardware_concurrency(), 1U);
+
+  return num_threads_;
+}
+
+void
+CContextFree::
+resolveRules()
+{
+  // resolve rule names up front so expansion never modifies the rule map
+  for (auto &rule : rules_)
+    rule.second->resolve();
+}
+
+void
+CContextFree::
+updateBBox(const CBBox2D &bbox)
+{
+  if (expandBuffer_)
+    expandBuffer_->bbox.add(bbox);
+  else
+    bbox_.add(bbox);
+}
+
+void
+CContextFree::
+expandAndRender()
+{
+  // shapes are drawn by a render thread as soon as they are created so nothing is
+  // buffered, this means shapes are drawn in creation order (no z or area sort)
+  static const uint queue_size = 4096;
+
+  if (! startExpand())
+    return;
+
+  StreamQueue queue(queue_size);
+
+  streamQueue_ = &queue;
+
+  std::thread renderThread([&]() {
+    // own path for path rules (expansion thread uses the main one)
+    ExpandBuffer buffer;
+
+    expandBuffer_ = &buffer;
+
+    adjustMatrix_.setIdentity();
+
+    fillBackground(bg_);
+
+    StreamQueue::Shape shape;
+
+    while (queue.pop(shape)) {
+      if (shape.rule)
+        shape.rule->exec(shape.state);
+      else
+        renderShape(shape.record, nullptr);
+    }
+
+    expandBuffer_ = nullptr;
+  });
+
+  expandRules(0, nullptr);
+
+  queue.close();
+
+  renderThread.join();
+
+  streamQueue_ = nullptr;
+}
+
+void
+CContextFree::
+render()
+{
+  renderTiles(nullptr);
+}
+
+void
+CContextFree::
+render(const CBBox2D &view)
+{
+  renderTiles(&view);
+}
+
+void
+CContextFree::
+renderTiles(const CBBox2D *view)
+{
+  adjustMatrix_.setIdentity();
+
+  fillBackground(bg_);
+
+  double xmin, ymin, xmax, ymax;
+
+  if (getTile(&xmin, &ymin, &xmax, &ymax)) {
+    double w = fabs(xmax - xmin);
+    double h = fabs(ymax - ymin);
+
+    int nl = 0; while (xmin > bbox_.getXMin()) { xmin -= w; ++nl; }
+    int nr = 0; while (xmax < bbox_.getXMax()) { xmax += w; ++nr; }
+    int nb = 0; while (ymin > bbox_.getYMin()) { ymin -= h; ++nb; }
+    int nt = 0; while (ymax < bbox_.getYMax()) { ymax += h; ++nt; }
+
+    int nx = nl + nr + 1;
+    int ny = nb + nt + 1;
+
+    for (int iy = 0; iy < ny; ++iy) {
+      double y = -(iy - nb)*h;
+
+      for (int ix = 0; ix < nx; ++ix) {
+        double x = -(ix - nl)*w;
+
+        if (view)
+          renderAt(x, y, *view);
+        else
+          renderAt(x, y);
+      }
+    }
+  }
+  else {
+    if (view)
+      renderAt(0, 0, *view);
+    else
+      renderAt(0, 0);
+  }
+}
+
+void
+CContextFree::
+renderAt(double x, double y)
+{
+  adjustMatrix_ = CMatrix2D::translation(x, y);
+
+  sortShapes();
+
+  // contiguous blocks of buffer passed as runs
+  size_t n = shapeBuffer_.shapes.size();
+
+  for (size_t i = 0; i < n; ) {
+    size_t nb = std::min(shapeBuffer_.shapes.contiguous(i), size_t(std::numeric_limits<uint>::max()));
+
+    renderShapes(&shapeBuffer_.shapes[i], uint(nb), &shapeBuffer_);
+
+    i += nb;
+  }
+}
+
+void
+CContextFree::
+renderAt(double x, double y, const CBBox2D &view)
+{
+  adjustMatrix_ = CMatrix2D::translation(x, y);
+
+  sortShapes();
+
+  buildSpatialIndex();
+
+  SpatialIndex &index = spatialIndex_;
+
+  if (! index.valid || ! view.isSet()) return;
+
+  // view in untranslated shape coords
+  double vxmin = view.getXMin() - x, vymin = view.getYMin() - y;
+  double vxmax = view.getXMax() - x, vymax = view.getYMax() - y;
+
+  auto cellX = [&](double px) {
+    return uint(std::min(std::max((px - index.xmin)/index.cw, 0.0), double(index.nx - 1))); };
+  auto cellY = [&](double py) {
+    return uint(std::min(std::max((py - index.ymin)/index.ch, 0.0), double(index.ny - 1))); };
+
+  auto inside = [&](uint32_t i) {
+    const float *b = &index.bboxes[4*i];
+
+    return ! (b[0] > vxmax || b[2] < vxmin || b[1] > vymax || b[3] < vymin);
+  };
+
+  // candidate shapes from overlapping cells and large shapes, merged back into
+  // render order (shape index)
+  auto &indices = index.viewShapes;
+
+  indices.clear();
+
+  uint ix1 = cellX(vxmin), ix2 = cellX(vxmax);
+  uint iy1 = cellY(vymin), iy2 = cellY(vymax);
+
+  for (uint iy = iy1; iy <= iy2; ++iy) {
+    for (uint ix = ix1; ix <= ix2; ++ix) {
+      uint cell = iy*index.nx + ix;
+
+      for (uint j = index.cellStart[cell]; j < index.cellStart[cell + 1]; ++j) {
+        uint32_t i = index.cellShapes[j];
+
+        if (inside(i))
+          indices.push_back(i);
+      }
+    }
+  }
+
+  for (const auto &i : index.largeShapes) {
+    if (inside(i))
+      indices.push_back(i);
+  }
+
+  std::sort(indices.begin(), indices.end());
+
+  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+
+  // runs of consecutive visible shapes (within a contiguous block) are drawn in place
+  // from the shape buffer
+  size_t i = 0;
+
+  while (i < indices.size()) {
+    size_t nb = shapeBuffer_.shapes.contiguous(indices[i]);
+
+    size_t j = i + 1;
+
+    while (j < indices.size() && j - i < nb && indices[j] == indices[j - 1] + 1)
+      ++j;
+
+    renderShapes(&shapeBuffer_.shapes[indices[i]], uint(j - i), &shapeBuffer_);
+
+    i = j;
+  }
+}
+
+void
+CContextFree::
+buildSpatialIndex()
+{
+  // grid over bbox of all shapes with about 8 shapes per cell
+  static const uint max_cells       = 1024;
+  static const uint max_shape_cells = 64;
+
+  SpatialIndex &index = spatialIndex_;
+
+  if (index.valid) return;
+
+  index.reset();
+
+  size_t n = shapeBuffer_.shapes.size();
+
+  if (n == 0) return;
+
+  index.bboxes.resize(4*n);
+
+  CBBox2D bbox;
+
+  for (size_t i = 0; i < n; ) {
+    size_t nb = shapeBuffer_.shapes.contiguous(i);
+
+    const ShapeRecord *shapes = &shapeBuffer_.shapes[i];
+
+    calcShapeExtents(shapes, uint(nb), &index.bboxes[4*i]);
+
+    for (size_t j = 0; j < nb; ++j) {
+      float *b = &index.bboxes[4*(i + j)];
+
+      if (shapes[j].getKind() == PATH_SHAPE) {
+        const CBBox2D &pbbox = shapeBuffer_.pathBBoxes[shapes[j].color];
+
+        if (! pbbox.isSet()) {
+          // no bbox (empty path) so never visible
+          b[0] = b[1] = 1.0f; b[2] = b[3] = -1.0f;
+
+          continue;
+        }
+
+        b[0] = float(pbbox.getXMin()); b[1] = float(pbbox.getYMin());
+        b[2] = float(pbbox.getXMax()); b[3] = float(pbbox.getYMax());
+      }
+
+      bbox.add(b[0], b[1]);
+      bbox.add(b[2], b[3]);
+    }
+
+    i += nb;
+  }
+
+  if (! bbox.isSet()) return;
+
+  double w = std::max(bbox.getWidth (), 1E-12);
+  double h = std::max(bbox.getHeight(), 1E-12);
+
+  double cs = sqrt(w*h*8.0/double(n));
+
+  index.nx   = std::min(std::max(uint(w/cs), 1U), max_cells);
+  index.ny   = std::min(std::max(uint(h/cs), 1U), max_cells);
+  index.xmin = bbox.getXMin();
+  index.ymin = bbox.getYMin();
+  index.cw   = w/index.nx;
+  index.ch   = h/index.ny;
+
+  auto cellRange = [&](const float *b, uint &ix1, uint &iy1, uint &ix2, uint &iy2) {
+    auto cx = [&](double x) {
+      return uint(std::min(std::max((x - index.xmin)/index.cw, 0.0), double(index.nx - 1))); };
+    auto cy = [&](double y) {
+      return uint(std::min(std::max((y - index.ymin)/index.ch, 0.0), double(index.ny - 1))); };
+
+    ix1 = cx(b[0]); iy1 = cy(b[1]); ix2 = cx(b[2]); iy2 = cy(b[3]);
+  };
+
+  // count shapes per cell, convert to starts then fill (in shape order)
+  uint num_cells = index.nx*index.ny;
+
+  index.cellStart.assign(num_cells + 1, 0);
+
+  std::vector<bool> large(n, false);
+
+  for (size_t i = 0; i < n; ++i) {
+    const float *b = &index.bboxes[4*i];
+
+    if (b[0] > b[2]) continue;
+
+    uint ix1, iy1, ix2, iy2;
+
+    cellRange(b, ix1, iy1, ix2, iy2);
+
+    if ((ix2 - ix1 + 1)*(iy2 - iy1 + 1) > max_shape_cells) {
+      large[i] = true;
+
+      index.largeShapes.push_back(uint32_t(i));
+
+      continue;
+    }
+
+    for (uint iy = iy1; iy <= iy2; ++iy)
+      for (uint ix = ix1; ix <= ix2; ++ix)
+        ++index.cellStart[iy*index.nx + ix + 1];
+  }
+
+  for (uint i = 0; i < num_cells; ++i)
+    index.cellStart[i + 1] += index.cellStart[i];
+
+  index.cellShapes.resize(index.cellStart[num_cells]);
+
+  std::vector<uint32_t> pos(index.cellStart.begin(), index.cellStart.end() - 1);
+
+  for (size_t i = 0; i < n; ++i) {
+    const float *b = &index.bboxes[4*i];
+
+    if (b[0] > b[2] || large[i]) continue;
+
+    uint ix1, iy1, ix2, iy2;
+
+    cellRange(b, ix1, iy1, ix2, iy2);
+
+    for (uint iy = iy1; iy <= iy2; ++iy)
+      for (uint ix = ix1; ix <= ix2; ++ix)
+        index.cellShapes[pos[iy*index.nx + ix]++] = uint32_t(i);
+  }
+
+  index.valid = true;
+}
+
+void
+CContextFree::
+sortShapes()
+{
+  // stable LSD radix sort of shapes on their 64 bit keys, done once per set of
+  // buffered shapes (rendering again only redraws)
+  if (shapesSorted_) return;
+
+  boundShapes();
+
+  shapesSorted_ = true;
+
+  spatialIndex_.reset();
+
+  size_t n = shapeBuffer_.shapes.size();
+
+  struct KeyIndex {
+    uint64_t key;
+    uint32_t ind;
+  };
+
+  std::vector<KeyIndex> items(n), items1(n);
+
+  for (size_t i = 0; i < n; ++i) {
+    items[i].key = shapeBuffer_.keys[i];
+    items[i].ind = uint32_t(i);
+  }
+
+  // each thread counts digits of its slice, slices are then scattered in order
+  // so the sort stays stable
+  static const uint radix_bits = 8;
+  static const uint radix_size = 1<<radix_bits;
+
+  uint num_threads = (n >= (1<<16) ? getNumThreads() : 1);
+
+  size_t slice = (n + num_threads - 1)/num_threads;
+
+  using Counts = std::vector<size_t>;
+
+  std::vector<Counts> counts(num_threads, Counts(radix_size));
+
+  auto runThreads = [&](const std::function<void(uint, size_t, size_t)> &proc) {
+    std::vector<std::thread> threads;
+
+    for (uint t = 1; t < num_threads; ++t)
+      threads.push_back(std::thread(proc, t, std::min(t*slice, n), std::min((t + 1)*slice, n)));
+
+    proc(0, 0, std::min(slice, n));
+
+    for (auto &thread : threads)
+      thread.join();
+  };
+
+  for (uint shift = 0; shift < 64; shift += radix_bits) {
+    runThreads([&](uint t, size_t i1, size_t i2) {
+      Counts &c = counts[t];
+
+      std::fill(c.begin(), c.end(), 0);
+
+      for (size_t i = i1; i < i2; ++i)
+        ++c[(items[i].key >> shift) & (radix_size - 1)];
+    });
+
+    // skip pass if all keys have the same digit
+    bool same = false;
+
+    for (uint d = 0; d < radix_size; ++d) {
+      size_t total = 0;
+
+      for (uint t = 0; t < num_threads; ++t)
+        total += counts[t][d];
+
+      if (total == n) { same = true; break; }
+      if (total >  0) break;
+    }
+
+    if (same) continue;
+
+    // convert counts to scatter positions (digit major, then thread)
+    size_t pos = 0;
+
+    for (uint d = 0; d < radix_size; ++d) {
+      for (uint t = 0; t < num_threads; ++t) {
+        size_t c = counts[t][d];
+
+        counts[t][d] = pos;
+
+        pos += c;
+      }
+    }
+
+    runThreads([&](uint t, size_t i1, size_t i2) {
+      Counts &c = counts[t];
+
+      for (size_t i = i1; i < i2; ++i)
+        items1[c[(items[i].key >> shift) & (radix_size - 1)]++] = items[i];
+    });
+
+    std::swap(items, items1);
+  }
+
+  //---
+
+  ShapeStack shapes;
+  KeyStack   keys;
+
+  shapes.reserve(n);
+  keys  .reserve(n);
+
+  for (const auto &item : items) {
+    shapes.push_back(shapeBuffer_.shapes[item.ind]);
+    keys  .push_back(item.key);
+  }
+
+  shapeBuffer_.shapes.swap(shapes);
+  shapeBuffer_.keys  .swap(keys);
+}
+
+void
+CContextFree::
+renderShape(const ShapeRecord &shape, const ShapeBuffer *buffer)
+{
+  ShapeKind kind = shape.getKind();
+
+  if (kind == PATH_SHAPE) {
+    const RuleState &ruleState = buffer->paths[shape.color];
+
+    ruleState.getRule()->exec(ruleState.getState());
+
+    return;
+  }
+
+  renderBatch(&shape, 1, adjustMatrix_);
+}
+
+void
+CContextFree::
+renderShapes(const ShapeRecord *shapes, uint n, const ShapeBuffer *buffer)
+{
+  // runs of primitives between paths are drawn by renderBatch
+  uint i = 0;
+
+  while (i < n) {
+    if (shapes[i].getKind() == PATH_SHAPE) {
+      renderShape(shapes[i], buffer);
+
+      ++i;
+
+      continue;
+    }
+
+    uint j = i + 1;
+
+    while (j < n && shapes[j].getKind() != PATH_SHAPE)
+      ++j;
+
+    renderBatch(&shapes[i], j - i, adjustMatrix_);
+
+    i = j;
+  }
+}
+
+void
+CContextFree::
+renderBatch(const ShapeRecord *shapes, uint n, const CMatrix2D &m)
+{
+  static const double h1 = 0.5/sqrt(3.0);
+  static const double h2 = 1.0/sqrt(3.0);
+
+  for (uint i = 0; i < n; ++i) {
+    const ShapeRecord &shape = shapes[i];
+
+    CMatrix2D m1;
+
+    m1.setValues(shape.m[0], shape.m[1], shape.m[2], shape.m[3], shape.m[4], shape.m[5]);
+
+    m1 = m*m1;
+
+    ShapeKind kind = shape.getKind();
+
+    if      (kind == SQUARE_SHAPE)
+      fillSquare(-0.5, -0.5, 0.5, 0.5, m1, shape.color);
+    else if (kind == CIRCLE_SHAPE)
+      fillCircle(0.0, 0.0, 0.5, m1, shape.color);
+    else if (kind == TRIANGLE_SHAPE)
+      fillTriangle(0.0, h2, -0.5, -h1, 0.5, -h1, m1, shape.color);
+  }
+}
+
+uint32_t
+CContextFree::
+packColor(const CHSVA &color)
+{
+  ShapeColor c;
+
+  c.h = float(color.getHue       ());
+  c.s = float(color.getSaturation());
+  c.v = float(color.getValue     ());
+  c.a = float(color.getAlpha     ());
+
+  uint32_t rgba;
+
+  calcShapeColors(&c, 1, &rgba);
+
+  return rgba;
+}
+
+void
+CContextFree::
+calcShapeColors(const ShapeColor *colors, uint n, uint32_t *rgba)
+{
+  // HSVA to RGBA8 (r in low byte) using the branch free form of the hexcone model,
+  // each channel is v - v*s*clamp(min(k, 4 - k), 0, 1) with k = (m + h/60) mod 6 for
+  // m = 5 (red), 3 (green) and 1 (blue). Blocks of 4 colors (SSE2) are transposed to
+  // vectors of each value, the rest are done one at a time with the same operations
+  uint i = 0;
+
+#if defined(__SSE2__)
+  {
+  const __m128 zero  = _mm_setzero_ps();
+  const __m128 one   = _mm_set1_ps(1.0f);
+  const __m128 four  = _mm_set1_ps(4.0f);
+  const __m128 six   = _mm_set1_ps(6.0f);
+  const __m128 v360  = _mm_set1_ps(360.0f);
+  const __m128 r360  = _mm_set1_ps(1.0f/360.0f);
+  const __m128 r60   = _mm_set1_ps(1.0f/60.0f);
+  const __m128 v255  = _mm_set1_ps(255.0f);
+  const __m128 half  = _mm_set1_ps(0.5f);
+
+  auto clamp01 = [&](__m128 x) { return _mm_min_ps(_mm_max_ps(x, zero), one); };
+
+  for ( ; i + 4 <= n; i += 4) {
+    __m128 h = _mm_loadu_ps(&colors[i    ].h), s = _mm_loadu_ps(&colors[i + 1].h);
+    __m128 v = _mm_loadu_ps(&colors[i + 2].h), a = _mm_loadu_ps(&colors[i + 3].h);
+
+    _MM_TRANSPOSE4_PS(h, s, v, a);
+
+    // hue in [0, 360)
+    h = _mm_sub_ps(h, _mm_mul_ps(v360, _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_mul_ps(h, r360)))));
+    h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), v360));
+
+    __m128 h6 = _mm_mul_ps(h, r60);
+
+    s = clamp01(s); v = clamp01(v); a = clamp01(a);
+
+    __m128 vs = _mm_mul_ps(v, s);
+
+    auto channel = [&](float m) {
+      __m128 k = _mm_add_ps(_mm_set1_ps(m), h6);
+
+      k = _mm_sub_ps(k, _mm_and_ps(_mm_cmpge_ps(k, six), six));
+
+      __m128 t = clamp01(_mm_min_ps(k, _mm_sub_ps(four, k)));
+
+      return _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(clamp01(_mm_sub_ps(v, _mm_mul_ps(vs, t))),
+                                                    v255), half));
+    };
+
+    __m128i r = channel(5.0f);
+    __m128i g = channel(3.0f);
+    __m128i b = channel(1.0f);
+
+    __m128i ai = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(a, v255), half));
+
+    __m128i c = _mm_or_si128(_mm_or_si128(r, _mm_slli_epi32(g, 8)),
+                             _mm_or_si128(_mm_slli_epi32(b, 16), _mm_slli_epi32(ai, 24)));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(&rgba[i]), c);
+  }
+  }
+#endif
+
+  auto clamp01 = [](float x) { return std::min(std::max(x, 0.0f), 1.0f); };
+
+  for ( ; i < n; ++i) {
+    const ShapeColor &color = colors[i];
+
+    float h = color.h - 360.0f*float(int(color.h*(1.0f/360.0f)));
+
+    if (h < 0.0f) h += 360.0f;
+
+    float h6 = h*(1.0f/60.0f);
+
+    float s = clamp01(color.s), v = clamp01(color.v), a = clamp01(color.a);
+
+    float vs = v*s;
+
+    auto channel = [&](float m) {
+      float k = m + h6;
+
+      if (k >= 6.0f) k -= 6.0f;
+
+      float t = clamp01(std::min(k, 4.0f - k));
+
+      return uint32_t(int(clamp01(v - vs*t)*255.0f + 0.5f));
+    };
+
+    rgba[i] = (channel(5.0f)      ) | (channel(3.0f) <<  8) |
+              (channel(1.0f) << 16) | (uint32_t(int(a*255.0f + 0.5f)) << 24);
+  }
+}
+
+CHSVA
+CContextFree::
+unpackColor(uint32_t color)
+{
+  double r = ((color      ) & 0xff)/255.0;
+  double g = ((color >>  8) & 0xff)/255.0;
+  double b = ((color >> 16) & 0xff)/255.0;
+  double a = ((color >> 24) & 0xff)/255.0;
+
+  double v = std::max(std::max(r, g), b);
+  double d = v - std::min(std::min(r, g), b);
+
+  if (d <= 0.0)
+    return CHSVA(0.0, 0.0, v, a);
+
+  double h;
+
+  if      (v == r) h = (g - b)/d;
+  else if (v == g) h = (b - r)/d + 2.0;
+  else             h = (r - g)/d + 4.0;
+
+  h *= 60.0;
+
+  if (h < 0.0) h += 360.0;
+
+  return CHSVA(h, d/v, v, a);
+}
+
+bool
+CContextFree::
+parseComment1()
+{
+  parse_->skipChars(2);
+
+  while (! parse_->eof() && (! parse_->isChar('*') || ! parse_->isNextChar('/')))
+    parse_->skipChar();
+
+  parse_->skipChars(2);
+
+  return true;
+}
+
+bool
+CContextFree::
+parseComment2()
+{
+  parse_->skipChars(2);
+
+  while (! parse_->eol())
+    parse_->skipChar();
+
+  return true;
+}
+
+bool
+CContextFree::
+parseComment3()
+{
+  parse_->skipChar();
+
+  while (! parse_->eol())
+    parse_->skipChar();
+
+  return true;
+}
+
+bool
+CContextFree::
+parseStartShape()
+{
+  // start_shape <user_string>
+  if (! parse_->isIdentifier())
+    return false;
+
+  std::string id;
+
+  if (! parseName(id)) return false;
+
+  setStartShape(id);
+
+  return true;
+}
+
+bool
+CContextFree::
+parseInclude()
+{
+  // include <user_string>
+  // include <user_filename>
+  std::string filename;
+
+  if (parse_->isChar('"')) {
+    if (! parse_->readString(filename))
+      return false;
+  }
+  else {
+    if (! parse_->readNonSpace(filename))
+      return false;
+  }
+
+  includes_.push_back(filename);
+
+  skipSpace();
+
+  return true;
+}
+
+bool
+CContextFree::
+parseBackground()
+{
+  // background { <color_adjustments> }
+  if (! parse_->isChar('{') && ! parse_->isChar('['))
+    return false;
+
+  char end_char = (parse_->isChar('{') ? '}' : ']');
+
+  parse_->skipChar();
+
+  skipSpace();
+
+  double hue = 0.0, saturation = 0.0, brightness = 0.0, alpha = 0.0;
+
+  while (! parse_->eof() && ! parse_->isChar(end_char)) {
+    std::string name;
+
+    if (! parseName(name)) return false;
+
+    if      (name == "hue" || name == "h") {
+      if (! parseReal(&hue)) hue = 0.0;
+
+      while (hue <    0.0) hue += 360.0;
+      while (hue >= 360.0) hue -= 360.0;
+    }
+    else if (name == "saturation" || name == "sat") {
+      if (! parseReal(&saturation)) saturation = 1.0;
+
+      saturation = std::min(std::max(saturation, -1.0), 1.0);
+    }
+    else if (name == "brightness" || name == "b") {
+      if (! parseReal(&brightness)) brightness = 1.0;
+
+      brightness = std::min(std::max(brightness, -1.0), 1.0);
+    }
+    else if (name == "alpha" || name == "a") {
+      if (! parseReal(&alpha)) alpha = 1.0;
+
+      alpha = std::min(std::max(alpha, -1.0), 1.0);
+    }
+    else {
+      error("Invalid background value " + name);
+    }
+
+    skipSpace();
+  }
+
+  if (! parse_->eof() && parse_->isChar(end_char)) {
+    parse_->skipChar();
+
+    skipSpace();
+  }
+
+  bg_ += CHSVA(hue, saturation, brightness, alpha);
+
+  return true;
+}
+
+bool
 CContextFree::
 parseTile()
 {
@@ -725,6 +2328,8 @@ parseAdjustment(Adjustment &adj)
 
     if (! compose)
       adj.buildMatrix();
+    else
+      adj.buildKind();
 
     return true;
   }
@@ -1000,6 +2605,10 @@ parsePathOpPart(PathOp pathOp)
     default               : assert(false); break;
   }
 
+  // stroke width is added to bbox unscaled so clip needs it as margin
+  if (pathOp == STROKE_PATH_OP)
+    strokeMargin_ = std::max(strokeMargin_, pathPoints.width.getValue(0.1)/2);
+
   return pathPart;
 }
 
@@ -1205,6 +2814,28 @@ parseReal(double *r)
   return true;
 }
 
+bool
+CContextFree::
+evalExpr(const std::string &expr, double *r)
+{
+  // rand_static values continue the parse stream so each call gets new values
+  CEval eval;
+
+  eval.setForceReal(true);
+  eval.setDegrees  (true);
+
+  eval.setRandStream(randStaticSeed_, randStaticCount_);
+
+  if (! eval.eval(expr, r)) {
+    error("Invalid expression: " + expr);
+    return false;
+  }
+
+  randStaticCount_ = eval.getRandCount();
+
+  return true;
+}
+
 bool
 CContextFree::
 parseRealValue(double *r)
@@ -1246,149 +2877,575 @@ parseRealValue(double *r)
 
       char c;
 
-      parse_->readChar(&c);
+      parse_->readChar(&c);
+
+      expr += c;
+    }
+
+    if (! parse_->eof() && parse_->isChar(')')) {
+      parse_->skipChar();
+    }
+
+    if (! evalExpr(expr, r))
+      return false;
+  }
+  else if (parse_->isAlpha()) {
+    std::string expr;
+
+    while (parse_->isAlpha() || parse_->isChar('_')) {
+      char c;
+
+      parse_->readChar(&c);
+
+      expr += c;
+    }
+
+    if (! parse_->isChar('(')) {
+      error("Missing (");
+      return false;
+    }
+
+    expr += '(';
+
+    parse_->skipChar();
+
+    while (! parse_->eof() && ! parse_->isChar(')')) {
+      char c;
+
+      parse_->readChar(&c);
+
+      expr += c;
+    }
+
+    if (! parse_->eof() && parse_->isChar(')')) {
+      parse_->skipChar();
+    }
+
+    expr += ')';
+
+    if (! evalExpr(expr, r))
+      return false;
+  }
+  else {
+    error("Invalid real char");
+    return false;
+  }
+
+  return true;
+}
+
+void
+CContextFree::
+skipSpace()
+{
+  parse_->skipSpace();
+
+  while (parse_->eol() && ! parse_->eof())
+    parse_->skipSpace();
+
+  while (skipComment()) {
+    parse_->skipSpace();
+
+    while (parse_->eol() && ! parse_->eof())
+      parse_->skipSpace();
+  }
+}
+
+bool
+CContextFree::
+skipComment()
+{
+  if (parse_->eof()) return false;
+
+  if      (parse_->isChar('/') && parse_->isNextChar('*'))
+    parseComment1();
+  else if (parse_->isChar('/') && parse_->isNextChar('/'))
+    parseComment2();
+  else if (parse_->isChar('#'))
+    parseComment3();
+  else
+    return false;
+
+  return true;
+}
+
+void
+CContextFree::
+setStartShape(const std::string &name)
+{
+  if (start_shape_ == "")
+    start_shape_ = name;
+}
+
+void
+CContextFree::
+fillBackground(const CHSVA &)
+{
+}
+
+void
+CContextFree::
+fillSquare(double, double, double, double, const CMatrix2D &, const CHSVA &)
+{
+}
+
+void
+CContextFree::
+fillCircle(double, double, double, const CMatrix2D &, const CHSVA &)
+{
+}
+
+void
+CContextFree::
+fillTriangle(double, double, double, double, double, double, const CMatrix2D &, const CHSVA &)
+{
+}
+
+void
+CContextFree::
+fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, uint32_t rgba)
+{
+  fillSquare(x1, y1, x2, y2, m, unpackColor(rgba));
+}
+
+void
+CContextFree::
+fillCircle(double x, double y, double r, const CMatrix2D &m, uint32_t rgba)
+{
+  fillCircle(x, y, r, m, unpackColor(rgba));
+}
+
+void
+CContextFree::
+fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+             const CMatrix2D &m, uint32_t rgba)
+{
+  fillTriangle(x1, y1, x2, y2, x3, y3, m, unpackColor(rgba));
+}
+
+void
+CContextFree::
+bufferRule(double z, Rule *rule, const State &state, const CBBox2D &bbox)
+{
+  ShapeKind kind = rule->getShapeKind();
+
+  bool stream = (streamQueue_ && ! expandBuffer_);
+
+  if (stream && kind == PATH_SHAPE) {
+    streamQueue_->push(rule, state);
+    return;
+  }
+
+  ShapeBuffer *shapeBuffer = (expandBuffer_ ? &expandBuffer_->shapeBuffer : &shapeBuffer_);
+
+  ShapeRecord shape;
+
+  shape.key = uint32_t(kind);
+
+  setAreaKey(shape, float(bbox.area()));
+
+  if (kind == PATH_SHAPE) {
+    shape.color = uint32_t(shapeBuffer->paths.size());
+
+    shapeBuffer->paths     .push_back(RuleState(rule, state, bbox.area()));
+    shapeBuffer->pathBBoxes.push_back(bbox);
+  }
+  else {
+    double m[6];
+
+    state.m.getValues(&m[0], &m[1], &m[2], &m[3], &m[4], &m[5]);
 
-      expr += c;
-    }
+    for (int i = 0; i < 6; ++i)
+      shape.m[i] = float(m[i]);
 
-    if (! parse_->eof() && parse_->isChar(')')) {
-      parse_->skipChar();
-    }
+    shape.color = packColor(state.color);
+  }
 
-    CEval eval;
+  if (stream) {
+    streamQueue_->push(shape);
+    return;
+  }
 
-    eval.setForceReal(true);
-    eval.setDegrees  (true);
+  // render order key: z ascending then area descending
+  shapeBuffer->shapes.push_back(shape);
+  shapeBuffer->keys  .push_back((uint64_t(depthKey(z)) << 32) | uint64_t(~shape.key));
+  shapeBuffer->colors.push_back(ShapeColor());
 
-    if (! eval.eval(expr, r)) {
-      error("Invalid expression: " + expr);
-      return false;
-    }
-  }
-  else if (parse_->isAlpha()) {
-    std::string expr;
+  shapeBuffered(shapeBuffer);
+}
 
-    while (parse_->isAlpha() || parse_->isChar('_')) {
-      char c;
+void
+CContextFree::
+bufferPrimitive(Rule *rule, const State &state)
+{
+  // square, circle or triangle record is bounded and its color packed later with
+  // other shapes of its block (see boundShapes) unless it is streamed
+  ShapeRecord shape;
 
-      parse_->readChar(&c);
+  double m[6];
 
-      expr += c;
-    }
+  state.m.getValues(&m[0], &m[1], &m[2], &m[3], &m[4], &m[5]);
 
-    if (! parse_->isChar('(')) {
-      error("Missing (");
-      return false;
-    }
+  for (int i = 0; i < 6; ++i)
+    shape.m[i] = float(m[i]);
 
-    expr += '(';
+  shape.key = uint32_t(rule->getShapeKind());
 
-    parse_->skipChar();
+  if (streamQueue_ && ! expandBuffer_) {
+    shape.color = packColor(state.color);
 
-    while (! parse_->eof() && ! parse_->isChar(')')) {
-      char c;
+    float b[4];
 
-      parse_->readChar(&c);
+    calcShapeExtents(&shape, 1, b);
 
-      expr += c;
-    }
+    setAreaKey(shape, (b[2] - b[0])*(b[3] - b[1]));
 
-    if (! parse_->eof() && parse_->isChar(')')) {
-      parse_->skipChar();
-    }
+    CBBox2D bbox;
 
-    expr += ')';
+    bbox.add(b[0], b[1]);
+    bbox.add(b[2], b[3]);
 
-    CEval eval;
+    updateBBox(bbox);
 
-    eval.setForceReal(true);
-    eval.setDegrees  (true);
+    streamQueue_->push(shape);
 
-    if (! eval.eval(expr, r)) {
-      error("Invalid expression: " + expr);
-      return false;
-    }
-  }
-  else {
-    error("Invalid real char");
-    return false;
+    return;
   }
 
-  return true;
-}
+  ShapeBuffer *shapeBuffer = (expandBuffer_ ? &expandBuffer_->shapeBuffer : &shapeBuffer_);
 
-void
-CContextFree::
-skipSpace()
-{
-  parse_->skipSpace();
+  ShapeColor color;
 
-  while (parse_->eol() && ! parse_->eof())
-    parse_->skipSpace();
+  color.h = float(state.color.getHue       ());
+  color.s = float(state.color.getSaturation());
+  color.v = float(state.color.getValue     ());
+  color.a = float(state.color.getAlpha     ());
 
-  while (skipComment()) {
-    parse_->skipSpace();
+  shapeBuffer->shapes.push_back(shape);
+  shapeBuffer->keys  .push_back(uint64_t(depthKey(state.z)) << 32);
+  shapeBuffer->colors.push_back(color);
 
-    while (parse_->eol() && ! parse_->eof())
-      parse_->skipSpace();
-  }
+  shapeBuffered(shapeBuffer);
 }
 
-bool
+void
 CContextFree::
-skipComment()
+shapeBuffered(ShapeBuffer *shapeBuffer)
 {
-  if (parse_->eof()) return false;
+  // bound each full block so the unpacked colors never exceed one block (a depth first
+  // or priority expansion has no generation ticks to do it)
+  if (shapeBuffer->colors.size() >= ShapeBuffer::block_size)
+    boundShapes(*shapeBuffer, expandBuffer_ ? expandBuffer_->bbox : bbox_);
 
-  if      (parse_->isChar('/') && parse_->isNextChar('*'))
-    parseComment1();
-  else if (parse_->isChar('/') && parse_->isNextChar('/'))
-    parseComment2();
-  else if (parse_->isChar('#'))
-    parseComment3();
-  else
-    return false;
-
-  return true;
+  if (! expandBuffer_)
+    shapesSorted_ = false;
 }
 
-void
+uint32_t
 CContextFree::
-setStartShape(const std::string &name)
+depthKey(double z)
 {
-  if (start_shape_ == "")
-    start_shape_ = name;
+  // float bits made order preserving
+  float fz = float(z);
+
+  uint32_t zkey;
+
+  memcpy(&zkey, &fz, sizeof(zkey));
+
+  return ((zkey & 0x80000000) ? ~zkey : (zkey | 0x80000000));
 }
 
 void
 CContextFree::
-fillBackground(const CHSVA &)
+setAreaKey(ShapeRecord &shape, float area)
 {
+  // area key is area float bits (order preserving for positive floats) with kind in low bits
+  uint32_t akey;
+
+  memcpy(&akey, &area, sizeof(akey));
+
+  shape.key = (akey & ~uint32_t(3)) | (shape.key & 3);
 }
 
 void
 CContextFree::
-fillSquare(double, double, double, double, const CMatrix2D &, const CHSVA &)
+boundShapes()
 {
+  boundShapes(shapeBuffer_, bbox_);
 }
 
 void
 CContextFree::
-fillCircle(double, double, double, const CMatrix2D &, const CHSVA &)
+boundShapes(ShapeBuffer &buffer, CBBox2D &bbox)
 {
+  // set area key, add bbox and pack color of primitive shapes buffered since last call,
+  // done in contiguous blocks (paths are bounded when buffered)
+  static const uint block_size = ShapeBuffer::block_size;
+
+  size_t i = buffer.numBounded;
+  size_t n = buffer.shapes.size();
+
+  if (i >= n) return;
+
+  float    bboxes[4*block_size];
+  uint32_t colors[block_size];
+
+  float xmin =  std::numeric_limits<float>::max(), ymin = xmin;
+  float xmax = -std::numeric_limits<float>::max(), ymax = xmax;
+
+  while (i < n) {
+    uint nb = uint(std::min(buffer.shapes.contiguous(i), size_t(block_size)));
+
+    ShapeRecord *shapes = &buffer.shapes[i];
+
+    calcShapeExtents(shapes, nb, bboxes);
+
+    calcShapeColors(&buffer.colors[i - buffer.numBounded], nb, colors);
+
+    for (uint j = 0; j < nb; ++j) {
+      ShapeRecord &shape = shapes[j];
+
+      if (shape.getKind() == PATH_SHAPE) continue;
+
+      shape.color = colors[j];
+
+      const float *b = &bboxes[4*j];
+
+      setAreaKey(shape, (b[2] - b[0])*(b[3] - b[1]));
+
+      uint64_t &key = buffer.keys[i + j];
+
+      key = (key & 0xffffffff00000000ULL) | uint64_t(~shape.key);
+
+      xmin = std::min(xmin, b[0]); ymin = std::min(ymin, b[1]);
+      xmax = std::max(xmax, b[2]); ymax = std::max(ymax, b[3]);
+    }
+
+    i += nb;
+  }
+
+  if (xmin <= xmax) {
+    bbox.add(xmin, ymin);
+    bbox.add(xmax, ymax);
+  }
+
+  buffer.colors.clear();
+
+  buffer.numBounded = n;
 }
 
 void
 CContextFree::
-fillTriangle(double, double, double, double, double, double, const CMatrix2D &, const CHSVA &)
-{
+calcShapeExtents(const ShapeRecord *shapes, uint n, float *bboxes)
+{
+  // bbox (xmin, ymin, xmax, ymax) of unit square, circle or triangle records from their
+  // matrix (x' = a*x + b*y + tx, y' = c*x + d*y + ty). Closed form half sizes are used
+  // for square, 0.5*(|a| + |b|), and circle (ellipse), 0.5*sqrt(a^2 + b^2), and the 3
+  // points for triangle. Blocks of 8 (AVX2) or 4 (SSE2) records are transposed to
+  // vectors of each value, the rest are done one at a time
+  static const float h1 = float(0.5/std::sqrt(3.0));
+  static const float h2 = float(1.0/std::sqrt(3.0));
+
+  uint i = 0;
+
+#if defined(__AVX2__)
+  {
+  const __m256 half  = _mm256_set1_ps(0.5f);
+  const __m256 vh1   = _mm256_set1_ps(h1);
+  const __m256 vh2   = _mm256_set1_ps(h2);
+  const __m256 sign  = _mm256_set1_ps(-0.0f);
+  const __m256i kmask = _mm256_set1_epi32(3);
+  const __m256i kcirc = _mm256_set1_epi32(CIRCLE_SHAPE);
+  const __m256i ktri  = _mm256_set1_epi32(TRIANGLE_SHAPE);
+
+  for ( ; i + 8 <= n; i += 8) {
+    // records are rows of 8 floats (a, b, c, d, tx, ty, color, key)
+    __m256 r[8];
+
+    for (int k = 0; k < 8; ++k)
+      r[k] = _mm256_loadu_ps(shapes[i + k].m);
+
+    __m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+    __m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+    __m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+    __m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+
+    __m256 u0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 u6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 u7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+    __m256 a   = _mm256_permute2f128_ps(u0, u4, 0x20);
+    __m256 b   = _mm256_permute2f128_ps(u1, u5, 0x20);
+    __m256 c   = _mm256_permute2f128_ps(u2, u6, 0x20);
+    __m256 d   = _mm256_permute2f128_ps(u3, u7, 0x20);
+    __m256 tx  = _mm256_permute2f128_ps(u0, u4, 0x31);
+    __m256 ty  = _mm256_permute2f128_ps(u1, u5, 0x31);
+    __m256 key = _mm256_permute2f128_ps(u3, u7, 0x31);
+
+    __m256i kind = _mm256_and_si256(_mm256_castps_si256(key), kmask);
+
+    __m256 is_circle   = _mm256_castsi256_ps(_mm256_cmpeq_epi32(kind, kcirc));
+    __m256 is_triangle = _mm256_castsi256_ps(_mm256_cmpeq_epi32(kind, ktri));
+
+    // square and circle
+    __m256 sx = _mm256_mul_ps(half, _mm256_add_ps(_mm256_andnot_ps(sign, a), _mm256_andnot_ps(sign, b)));
+    __m256 sy = _mm256_mul_ps(half, _mm256_add_ps(_mm256_andnot_ps(sign, c), _mm256_andnot_ps(sign, d)));
+    __m256 cx = _mm256_mul_ps(half, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(a, a), _mm256_mul_ps(b, b))));
+    __m256 cy = _mm256_mul_ps(half, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(c, c), _mm256_mul_ps(d, d))));
+
+    __m256 hx = _mm256_blendv_ps(sx, cx, is_circle);
+    __m256 hy = _mm256_blendv_ps(sy, cy, is_circle);
+
+    __m256 xmin = _mm256_sub_ps(tx, hx), xmax = _mm256_add_ps(tx, hx);
+    __m256 ymin = _mm256_sub_ps(ty, hy), ymax = _mm256_add_ps(ty, hy);
+
+    // triangle points (0, h2), (-0.5, -h1), (0.5, -h1)
+    __m256 px1 = _mm256_mul_ps(b, vh2), py1 = _mm256_mul_ps(d, vh2);
+    __m256 px2 = _mm256_mul_ps(half, a), py2 = _mm256_mul_ps(half, c);
+    __m256 px3 = _mm256_mul_ps(vh1, b), py3 = _mm256_mul_ps(vh1, d);
+
+    __m256 qx1 = _mm256_sub_ps(_mm256_sub_ps(tx, px2), px3), qx2 = _mm256_sub_ps(_mm256_add_ps(tx, px2), px3);
+    __m256 qy1 = _mm256_sub_ps(_mm256_sub_ps(ty, py2), py3), qy2 = _mm256_sub_ps(_mm256_add_ps(ty, py2), py3);
+    __m256 qx0 = _mm256_add_ps(tx, px1), qy0 = _mm256_add_ps(ty, py1);
+
+    xmin = _mm256_blendv_ps(xmin, _mm256_min_ps(qx0, _mm256_min_ps(qx1, qx2)), is_triangle);
+    xmax = _mm256_blendv_ps(xmax, _mm256_max_ps(qx0, _mm256_max_ps(qx1, qx2)), is_triangle);
+    ymin = _mm256_blendv_ps(ymin, _mm256_min_ps(qy0, _mm256_min_ps(qy1, qy2)), is_triangle);
+    ymax = _mm256_blendv_ps(ymax, _mm256_max_ps(qy0, _mm256_max_ps(qy1, qy2)), is_triangle);
+
+    alignas(32) float v[4][8];
+
+    _mm256_store_ps(v[0], xmin); _mm256_store_ps(v[1], ymin);
+    _mm256_store_ps(v[2], xmax); _mm256_store_ps(v[3], ymax);
+
+    for (int k = 0; k < 8; ++k) {
+      float *bbox = &bboxes[4*(i + k)];
+
+      bbox[0] = v[0][k]; bbox[1] = v[1][k]; bbox[2] = v[2][k]; bbox[3] = v[3][k];
+    }
+  }
+  }
+#endif
+
+#if defined(__SSE2__)
+  {
+  const __m128 half  = _mm_set1_ps(0.5f);
+  const __m128 vh1   = _mm_set1_ps(h1);
+  const __m128 vh2   = _mm_set1_ps(h2);
+  const __m128 sign  = _mm_set1_ps(-0.0f);
+  const __m128i kmask = _mm_set1_epi32(3);
+  const __m128i kcirc = _mm_set1_epi32(CIRCLE_SHAPE);
+  const __m128i ktri  = _mm_set1_epi32(TRIANGLE_SHAPE);
+
+  auto select = [](__m128 mask, __m128 v1, __m128 v2) {
+    return _mm_or_ps(_mm_and_ps(mask, v2), _mm_andnot_ps(mask, v1)); };
+
+  for ( ; i + 4 <= n; i += 4) {
+    // records are rows of (a, b, c, d) and (tx, ty, color, key)
+    __m128 a   = _mm_loadu_ps(shapes[i    ].m    ), b  = _mm_loadu_ps(shapes[i + 1].m    );
+    __m128 c   = _mm_loadu_ps(shapes[i + 2].m    ), d  = _mm_loadu_ps(shapes[i + 3].m    );
+    __m128 tx  = _mm_loadu_ps(shapes[i    ].m + 4), ty = _mm_loadu_ps(shapes[i + 1].m + 4);
+    __m128 col = _mm_loadu_ps(shapes[i + 2].m + 4), key = _mm_loadu_ps(shapes[i + 3].m + 4);
+
+    _MM_TRANSPOSE4_PS(a, b, c, d);
+    _MM_TRANSPOSE4_PS(tx, ty, col, key);
+
+    __m128i kind = _mm_and_si128(_mm_castps_si128(key), kmask);
+
+    __m128 is_circle   = _mm_castsi128_ps(_mm_cmpeq_epi32(kind, kcirc));
+    __m128 is_triangle = _mm_castsi128_ps(_mm_cmpeq_epi32(kind, ktri));
+
+    // square and circle
+    __m128 sx = _mm_mul_ps(half, _mm_add_ps(_mm_andnot_ps(sign, a), _mm_andnot_ps(sign, b)));
+    __m128 sy = _mm_mul_ps(half, _mm_add_ps(_mm_andnot_ps(sign, c), _mm_andnot_ps(sign, d)));
+    __m128 cx = _mm_mul_ps(half, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(a, a), _mm_mul_ps(b, b))));
+    __m128 cy = _mm_mul_ps(half, _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(c, c), _mm_mul_ps(d, d))));
+
+    __m128 hx = select(is_circle, sx, cx);
+    __m128 hy = select(is_circle, sy, cy);
+
+    __m128 xmin = _mm_sub_ps(tx, hx), xmax = _mm_add_ps(tx, hx);
+    __m128 ymin = _mm_sub_ps(ty, hy), ymax = _mm_add_ps(ty, hy);
+
+    // triangle points (0, h2), (-0.5, -h1), (0.5, -h1)
+    __m128 px1 = _mm_mul_ps(b, vh2), py1 = _mm_mul_ps(d, vh2);
+    __m128 px2 = _mm_mul_ps(half, a), py2 = _mm_mul_ps(half, c);
+    __m128 px3 = _mm_mul_ps(vh1, b), py3 = _mm_mul_ps(vh1, d);
+
+    __m128 qx1 = _mm_sub_ps(_mm_sub_ps(tx, px2), px3), qx2 = _mm_sub_ps(_mm_add_ps(tx, px2), px3);
+    __m128 qy1 = _mm_sub_ps(_mm_sub_ps(ty, py2), py3), qy2 = _mm_sub_ps(_mm_add_ps(ty, py2), py3);
+    __m128 qx0 = _mm_add_ps(tx, px1), qy0 = _mm_add_ps(ty, py1);
+
+    xmin = select(is_triangle, xmin, _mm_min_ps(qx0, _mm_min_ps(qx1, qx2)));
+    xmax = select(is_triangle, xmax, _mm_max_ps(qx0, _mm_max_ps(qx1, qx2)));
+    ymin = select(is_triangle, ymin, _mm_min_ps(qy0, _mm_min_ps(qy1, qy2)));
+    ymax = select(is_triangle, ymax, _mm_max_ps(qy0, _mm_max_ps(qy1, qy2)));
+
+    _MM_TRANSPOSE4_PS(xmin, ymin, xmax, ymax);
+
+    _mm_storeu_ps(&bboxes[4*i     ], xmin);
+    _mm_storeu_ps(&bboxes[4*i +  4], ymin);
+    _mm_storeu_ps(&bboxes[4*i +  8], xmax);
+    _mm_storeu_ps(&bboxes[4*i + 12], ymax);
+  }
+  }
+#endif
+
+  for ( ; i < n; ++i) {
+    const ShapeRecord &shape = shapes[i];
+
+    float a  = shape.m[0], b  = shape.m[1], c = shape.m[2], d = shape.m[3];
+    float tx = shape.m[4], ty = shape.m[5];
+
+    float *bbox = &bboxes[4*i];
+
+    if (shape.getKind() == TRIANGLE_SHAPE) {
+      float px1 = b*h2   , py1 = d*h2;
+      float px2 = 0.5f*a , py2 = 0.5f*c;
+      float px3 = h1*b   , py3 = h1*d;
+
+      float qx0 = tx + px1, qx1 = (tx - px2) - px3, qx2 = (tx + px2) - px3;
+      float qy0 = ty + py1, qy1 = (ty - py2) - py3, qy2 = (ty + py2) - py3;
+
+      bbox[0] = std::min(qx0, std::min(qx1, qx2));
+      bbox[1] = std::min(qy0, std::min(qy1, qy2));
+      bbox[2] = std::max(qx0, std::max(qx1, qx2));
+      bbox[3] = std::max(qy0, std::max(qy1, qy2));
+    }
+    else {
+      float hx, hy;
+
+      if (shape.getKind() == CIRCLE_SHAPE) {
+        hx = 0.5f*std::sqrt(a*a + b*b);
+        hy = 0.5f*std::sqrt(c*c + d*d);
+      }
+      else {
+        hx = 0.5f*(std::abs(a) + std::abs(b));
+        hy = 0.5f*(std::abs(c) + std::abs(d));
+      }
+
+      bbox[0] = tx - hx; bbox[1] = ty - hy;
+      bbox[2] = tx + hx; bbox[3] = ty + hy;
+    }
+  }
 }
 
-void
-CContextFree::
-bufferRule(double z, Rule *rule, const State &state, const CBBox2D &bbox)
+float
+CContextFree::ShapeRecord::
+getArea() const
 {
-  zRuleStack_[int(100*z)].push_back(RuleState(rule, state, bbox.area()));
+  float area;
+
+  uint32_t key1 = key & ~uint32_t(3);
+
+  memcpy(&area, &key1, sizeof(area));
+
+  return area;
 }
 
 void
@@ -1475,10 +3532,49 @@ pushRule(Rule *rule, const State &state)
 {
   if (rule->isBasic())
     rule->expand(state);
+  else
+    pushRuleState(rule, state);
+}
+
+void
+CContextFree::
+pushRuleState(Rule *rule, const State &state)
+{
+  if (! checkClip(rule, state)) return;
+
+  if      (expandBuffer_)
+    expandBuffer_->ruleStack.push_back(RuleState(rule, state));
+  else if (expandMode_ == PRIORITY_EXPAND) {
+    double s = getStateSize(state);
+
+    ruleStack_.push_back(RuleState(rule, state, s*s));
+
+    std::push_heap(ruleStack_.begin(), ruleStack_.end(), CContextFreeSizeCmp());
+  }
   else
     ruleStack_.push_back(RuleState(rule, state));
 }
 
+void
+CContextFree::
+incNumShapes()
+{
+  if (expandBuffer_)
+    ++expandBuffer_->num_shapes;
+  else
+    ++num_shapes_;
+}
+
+CContextFreePath *
+CContextFree::
+getPath()
+{
+  if (expandBuffer_)
+    return &expandBuffer_->path;
+
+  return path_;
+}
+
 void
 CContextFree::
 dumpRuleStack()
@@ -1498,11 +3594,11 @@ bool
 CContextFree::
 checkSizeLimit(const State &state)
 {
-  double sx, sy;
+  // use tracked scale bounds and only check matrix size when near limit
+  if (state.smax < sizeCullLimit_) return true;
+  if (state.smin > sizeKeepLimit_) return false;
 
-  state.m.getSize(&sx, &sy);
-
-  double s = std::max(sx, sy);
+  double s = getStateSize(state);
 
   double ps = s/pixelSize_;
 
@@ -1511,18 +3607,61 @@ checkSizeLimit(const State &state)
 
 bool
 CContextFree::
-checkMaxShapes() const
+checkClip(const Rule *rule, const State &state) const
 {
-  if (max_shapes_ == 0) return false;
+  // false if rule's bound (circle about state origin) is outside clip
+  if (! clip_.isSet() || tile_.is_set) return true;
+
+  double r = rule->getBound();
+
+  if (std::isinf(r)) return true;
+
+  double a, b, c, d, tx, ty;
+
+  state.m.getValues(&a, &b, &c, &d, &tx, &ty);
 
-  return (num_shapes_ >= max_shapes_);
+  double rs = state.smax*r + strokeMargin_;
+
+  return ! (tx + rs < clip_.getXMin() || tx - rs > clip_.getXMax() ||
+            ty + rs < clip_.getYMin() || ty - rs > clip_.getYMax());
+}
+
+void
+CContextFree::
+updateSizeLimits()
+{
+  // margin keeps bound checks on the same side as the exact check
+  double l = min_size_*pixelSize_;
+
+  sizeCullLimit_ = l*(1 - 1E-9);
+  sizeKeepLimit_ = l*(1 + 1E-9);
 }
 
 double
 CContextFree::
-randIn(double min_val, double max_val)
+getStateSize(const State &state)
+{
+  double sx, sy;
+
+  state.m.getSize(&sx, &sy);
+
+  return std::max(sx, sy);
+}
+
+bool
+CContextFree::
+checkMaxShapes() const
+{
+  return checkMaxShapesBase(expandBuffer_ ? expandBuffer_->num_shapes : 0);
+}
+
+bool
+CContextFree::
+checkMaxShapesBase(uint num_shapes) const
 {
-  return (max_val - min_val)*((1.0*rand())/RAND_MAX) + min_val;
+  if (max_shapes_ == 0) return false;
+
+  return (num_shapes_ + num_shapes >= max_shapes_);
 }
 
 void
@@ -1541,39 +3680,129 @@ adjustState(const State &state, const Adjustment &adj)
 {
   State state1 = state;
 
-  if (adj.z.isValid())
-    state1.z += adj.z.getValue();
+  adjustTransform(state1, adj);
+  adjustColor    (state1, adj);
 
-  if (adj.sz.isValid())
-    state1.sz *= adj.sz.getValue();
+  return state1;
+}
+
+bool
+CContextFree::
+adjustChildState(const State &state, const Adjustment &adj, State &state1)
+{
+  // apply transform and check size before any color work so culled children are cheap
+  state1 = state;
+
+  adjustTransform(state1, adj);
+
+  if (checkSizeLimit(state1))
+    return false;
+
+  adjustColor(state1, adj);
+
+  return true;
+}
+
+void
+CContextFree::
+adjustTransform(State &state, const Adjustment &adj)
+{
+  using AdjustProc = void (*)(State &, const Adjustment &);
+
+  using A = Adjustment;
+
+  // translate, linear, depth and similarity bits select the specialization
+  static AdjustProc procs[16] = {
+    &adjustTransformT<0>,
+    &adjustTransformT<A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_LINEAR>,
+    &adjustTransformT<A::KIND_LINEAR | A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_DEPTH>,
+    &adjustTransformT<A::KIND_DEPTH | A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_DEPTH | A::KIND_LINEAR>,
+    &adjustTransformT<A::KIND_DEPTH | A::KIND_LINEAR | A::KIND_TRANSLATE>,
+    // similarity flag is only set with linear
+    &adjustTransformT<0>,
+    &adjustTransformT<A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_SIMILAR | A::KIND_LINEAR>,
+    &adjustTransformT<A::KIND_SIMILAR | A::KIND_LINEAR | A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_DEPTH>,
+    &adjustTransformT<A::KIND_DEPTH | A::KIND_TRANSLATE>,
+    &adjustTransformT<A::KIND_SIMILAR | A::KIND_DEPTH | A::KIND_LINEAR>,
+    &adjustTransformT<A::KIND_SIMILAR | A::KIND_DEPTH | A::KIND_LINEAR | A::KIND_TRANSLATE>
+  };
+
+  procs[adj.kind & (A::KIND_TRANSLATE | A::KIND_LINEAR | A::KIND_DEPTH | A::KIND_SIMILAR)]
+    (state, adj);
+}
+
+template<uint KIND>
+void
+CContextFree::
+adjustTransformT(State &state, const Adjustment &adj)
+{
+  if constexpr ((KIND & Adjustment::KIND_DEPTH) != 0) {
+    if (adj.z.isValid())
+      state.z += adj.z.getValue();
+
+    if (adj.sz.isValid())
+      state.sz *= adj.sz.getValue();
+  }
+
+  if constexpr ((KIND & Adjustment::KIND_SIMILAR) != 0) {
+    // rotate, uniform scale and flip scale both bounds by one factor (size limit margin
+    // covers matrix product rounding)
+    state.m *= adj.m;
+
+    state.smin *= adj.s;
+    state.smax *= adj.s;
+  }
+  else if constexpr ((KIND & Adjustment::KIND_LINEAR) != 0) {
+    state.m *= adj.m;
 
-  state1.m *= adj.m;
+    state.smin *= adj.smin;
+    state.smax *= adj.smax;
+  }
+  else if constexpr ((KIND & Adjustment::KIND_TRANSLATE) != 0) {
+    // translation only: just move matrix origin
+    double a, b, c, d, tx, ty;
+
+    state.m.getValues(&a, &b, &c, &d, &tx, &ty);
 
-  if (adj.hue       .isValid() || adj.saturation.isValid() ||
-      adj.brightness.isValid() || adj.alpha     .isValid()) {
-    double h = adjustHueValue  (state1. color.getHue       (), adj. hue       .getValue(0.0),
-                                state1.lcolor.getHue       (), adj.thue);
-    double s = adjustColorValue(state1. color.getSaturation(), adj. saturation.getValue(0.0),
-                                state1.lcolor.getSaturation(), adj.tsaturation);
-    double b = adjustColorValue(state1. color.getValue     (), adj. brightness.getValue(0.0),
-                                state1.lcolor.getValue     (), adj.tbrightness);
-    double a = adjustColorValue(state1. color.getAlpha     (), adj. alpha     .getValue(0.0),
-                                state1.lcolor.getAlpha     (), adj.talpha);
+    state.m.multiplyPoint(adj.tx, adj.ty, &tx, &ty);
 
-    state1.color = CHSVA(h, s, b, a);
+    state.m.setValues(a, b, c, d, tx, ty);
   }
+}
 
-  if (adj.lhue       .isValid() || adj.lsaturation.isValid() ||
-      adj.lbrightness.isValid() || adj.lalpha     .isValid()) {
-    double h = adjustHueValue  (state1.lcolor.getHue       (), adj.lhue       .getValue(0.0));
-    double s = adjustColorValue(state1.lcolor.getSaturation(), adj.lsaturation.getValue(0.0));
-    double b = adjustColorValue(state1.lcolor.getValue     (), adj.lbrightness.getValue(0.0));
-    double a = adjustColorValue(state1.lcolor.getAlpha     (), adj.lalpha     .getValue(0.0));
+void
+CContextFree::
+adjustColor(State &state, const Adjustment &adj)
+{
+  if (! (adj.kind & (Adjustment::KIND_COLOR | Adjustment::KIND_LCOLOR)))
+    return;
 
-    state1.lcolor = CHSVA(h, s, b, a);
+  if (adj.kind & Adjustment::KIND_COLOR) {
+    double h = adjustHueValue  (state. color.getHue       (), adj. hue       .getValue(0.0),
+                                state.lcolor.getHue       (), adj.thue);
+    double s = adjustColorValue(state. color.getSaturation(), adj. saturation.getValue(0.0),
+                                state.lcolor.getSaturation(), adj.tsaturation);
+    double b = adjustColorValue(state. color.getValue     (), adj. brightness.getValue(0.0),
+                                state.lcolor.getValue     (), adj.tbrightness);
+    double a = adjustColorValue(state. color.getAlpha     (), adj. alpha     .getValue(0.0),
+                                state.lcolor.getAlpha     (), adj.talpha);
+
+    state.color = CHSVA(h, s, b, a);
   }
 
-  return state1;
+  if (adj.kind & Adjustment::KIND_LCOLOR) {
+    double h = adjustHueValue  (state.lcolor.getHue       (), adj.lhue       .getValue(0.0));
+    double s = adjustColorValue(state.lcolor.getSaturation(), adj.lsaturation.getValue(0.0));
+    double b = adjustColorValue(state.lcolor.getValue     (), adj.lbrightness.getValue(0.0));
+    double a = adjustColorValue(state.lcolor.getAlpha     (), adj.lalpha     .getValue(0.0));
+
+    state.lcolor = CHSVA(h, s, b, a);
+  }
 }
 
 double
@@ -1642,28 +3871,80 @@ buildMatrix()
 
   CMatrix2D tr = CMatrix2D::translation(x.getValue(0.0), y.getValue(0.0));
 
-  double rrotate = M_PI*rotate.getValue(0.0)/180.0;
+  double rrotate = M_PI*rotate.getValue(0.0)/180.0;
+
+  CMatrix2D rot = CMatrix2D::rotation(rrotate);
+
+  CMatrix2D sc = CMatrix2D::scale(sx.getValue(1.0), sy.getValue(1.0));
+
+  double rskewx = M_PI*skew_x.getValue(0.0)/180.0;
+  double rskewy = M_PI*skew_y.getValue(0.0)/180.0;
+
+  CMatrix2D sk = CMatrix2D::skew(rskewx, rskewy);
+
+  CMatrix2D ref;
+
+  if (flip.isValid()) {
+    double rflip = M_PI*flip.getValue()/180.0;
+
+    ref = CMatrix2D::reflection(rflip);
+  }
+  else
+    ref.setIdentity();
+
+  m = tr*rot*sc*sk*ref;
+
+  buildKind();
+}
+
+void
+CContextFree::Adjustment::
+buildKind()
+{
+  kind = 0;
+
+  double a, b, c, d;
+
+  m.getValues(&a, &b, &c, &d, &tx, &ty);
 
-  CMatrix2D rot = CMatrix2D::rotation(rrotate);
+  if (tx != 0.0 || ty != 0.0)
+    kind |= KIND_TRANSLATE;
 
-  CMatrix2D sc = CMatrix2D::scale(sx.getValue(1.0), sy.getValue(1.0));
+  smin = 1.0;
+  smax = 1.0;
+  s    = 1.0;
 
-  double rskewx = M_PI*skew_x.getValue(0.0)/180.0;
-  double rskewy = M_PI*skew_y.getValue(0.0)/180.0;
+  if (a != 1.0 || b != 0.0 || c != 0.0 || d != 1.0) {
+    kind |= KIND_LINEAR;
 
-  CMatrix2D sk = CMatrix2D::skew(rskewx, rskewy);
+    // columns orthogonal and same length: one scale (column length), else singular
+    // values of 2x2 part. Bounds are widened to cover rounding of state matrix product
+    if (std::abs(a*b + c*d) < 1E-12 && std::abs((a*a + c*c) - (b*b + d*d)) < 1E-12) {
+      kind |= KIND_SIMILAR;
 
-  CMatrix2D ref;
+      s = std::hypot(a, c);
 
-  if (flip.isValid()) {
-    double rflip = M_PI*flip.getValue()/180.0;
+      smax = s*(1 + 1E-12);
+      smin = s*(1 - 1E-12);
+    }
+    else {
+      double s2  = a*a + b*b + c*c + d*d;
+      double det = a*d - b*c;
+      double r   = std::sqrt(std::max(s2*s2 - 4*det*det, 0.0));
 
-    ref = CMatrix2D::reflection(rflip);
+      smax = std::sqrt((s2 + r)/2)*(1 + 1E-12);
+      smin = std::sqrt(std::max((s2 - r)/2, 0.0))*(1 - 1E-12);
+    }
   }
-  else
-    ref.setIdentity();
 
-  m = tr*rot*sc*sk*ref;
+  if (z.isValid() || sz.isValid())
+    kind |= KIND_DEPTH;
+
+  if (hue.isValid() || saturation.isValid() || brightness.isValid() || alpha.isValid())
+    kind |= KIND_COLOR;
+
+  if (lhue.isValid() || lsaturation.isValid() || lbrightness.isValid() || lalpha.isValid())
+    kind |= KIND_LCOLOR;
 }
 
 //--------------
@@ -1774,23 +4055,139 @@ addActionList(ActionList *actionList)
   totalWeight_ += actionList->getWeight();
 }
 
+void
+CContextFree::Rule::
+resolve()
+{
+  for (auto &actionList : actionLists_)
+    actionList->resolve(c_);
+
+  buildAliasTable();
+}
+
+void
+CContextFree::Rule::
+buildAliasTable()
+{
+  // Vose's method: pair each under full (scaled weight < 1) entry with an over full one
+  // which gives it the rest of its slot
+  aliasTable_.clear();
+
+  uint n = uint(actionLists_.size());
+
+  if (n < 2 || totalWeight_ <= 0.0) return;
+
+  aliasTable_.resize(n);
+
+  std::vector<double> p(n);
+  std::vector<uint>   small, large;
+
+  for (uint i = 0; i < n; ++i) {
+    p[i] = actionLists_[i]->getWeight()*n/totalWeight_;
+
+    if (p[i] < 1.0)
+      small.push_back(i);
+    else
+      large.push_back(i);
+  }
+
+  while (! small.empty() && ! large.empty()) {
+    uint l = small.back(); small.pop_back();
+    uint g = large.back(); large.pop_back();
+
+    aliasTable_[l].prob  = p[l];
+    aliasTable_[l].alias = g;
+
+    p[g] = (p[g] + p[l]) - 1.0;
+
+    if (p[g] < 1.0)
+      small.push_back(g);
+    else
+      large.push_back(g);
+  }
+
+  // left over entries are full (up to rounding)
+  for (auto i : large) aliasTable_[i] = Alias { 1.0, i };
+  for (auto i : small) aliasTable_[i] = Alias { 1.0, i };
+}
+
+double
+CContextFree::Rule::
+calcBound()
+{
+  double r = 0.0;
+
+  for (auto &actionList : actionLists_)
+    r = std::max(r, actionList->calcBound());
+
+  return r;
+}
+
+void
+CContextFree::Rule::
+visitChildren(double s, double p, double limit, const ChildProc &proc) const
+{
+  if (totalWeight_ <= 0.0) return;
+
+  for (auto &actionList : actionLists_)
+    actionList->visitChildren(s, p*actionList->getWeight()/totalWeight_, limit, proc);
+}
+
+void
+CContextFree::Rule::
+compile(Code &code)
+{
+  for (auto &actionList : actionLists_)
+    actionList->compile(code);
+}
+
 void
 CContextFree::Rule::
 expand(const State &state)
 {
-  if (c_->checkMaxShapes()) return;
+  // rule chains (single non-basic child in tail position) are expanded here in place
+  // instead of queuing the child for the next generation, the child's state is the
+  // same so the shapes are too. Priority mode needs all rules queued and long chains
+  // are queued after max_chain steps so budget checks still happen
+  static const uint max_chain = 4096;
 
-  ActionList *actionList = getActionList();
+  bool chain = (c_->expandMode_ != PRIORITY_EXPAND);
 
-  if (actionList)
-    actionList->expand(c_, state);
+  Rule *rule   = this;
+  State state1 = state;
+  State state2;
+
+  for (uint i = 0; rule; ++i) {
+    if (c_->checkMaxShapes()) return;
+
+    ActionList *actionList = rule->getActionList(state1);
+
+    if (! actionList) return;
+
+    if (actionList->codeStart() < 0 || c_->code_.empty()) {
+      actionList->expand(c_, state1);
+      return;
+    }
+
+    rule = c_->execCode(uint(actionList->codeStart()), state1,
+                        (chain && i < max_chain ? &state2 : nullptr));
+
+    if (rule) {
+      std::swap(state1, state2);
+
+      if (c_->expandBuffer_)
+        ++c_->expandBuffer_->num_chained;
+      else
+        ++c_->expandStats_.num_chained;
+    }
+  }
 }
 
 void
 CContextFree::Rule::
 exec(const State &state)
 {
-  ActionList *actionList = getActionList();
+  ActionList *actionList = getActionList(state);
 
   if (actionList)
     actionList->exec(c_, state);
@@ -1798,7 +4195,7 @@ exec(const State &state)
 
 CContextFree::ActionList *
 CContextFree::Rule::
-getActionList()
+getActionList(const State &state)
 {
   ActionList *actionList = nullptr;
 
@@ -1808,21 +4205,17 @@ getActionList()
     actionList = actionLists_[0];
   }
   else if (num_action_lists > 1) {
-    double r = CContextFree::randIn(0.0, totalWeight_);
+    if (aliasTable_.empty())
+      return actionLists_[0];
 
-    double t1 = 0.0;
-    double t2 = 0.0;
+    // slot from integer part of random value, slot's list or alias from fraction
+    double r = Rand::randIn(state.seed, 0, 0.0, double(num_action_lists));
 
-    for (uint i = 0; i < num_action_lists; ++ i) {
-      actionList = actionLists_[i];
+    uint i = std::min(uint(r), num_action_lists - 1);
 
-      t1 = t2;
-      t2 = t1 + actionList->getWeight();
+    const Alias &alias = aliasTable_[i];
 
-      if (r < t1 || r > t2) continue;
-
-      break;
-    }
+    actionList = actionLists_[r - i < alias.prob ? i : alias.alias];
   }
 
   return actionList;
@@ -1845,6 +4238,65 @@ CContextFree::ActionList::
     delete actions_[i];
 }
 
+void
+CContextFree::ActionList::
+resolve(CContextFree *c)
+{
+  for (auto &action : actions_)
+    action->resolve(c);
+}
+
+double
+CContextFree::ActionList::
+calcBound() const
+{
+  double r = 0.0;
+
+  for (auto &action : actions_)
+    r = std::max(r, action->calcBound());
+
+  return r;
+}
+
+void
+CContextFree::ActionList::
+visitChildren(double s, double p, double limit, const ChildProc &proc) const
+{
+  for (auto &action : actions_)
+    action->visitChildren(s, p, limit, proc);
+}
+
+void
+CContextFree::ActionList::
+compile(Code &code)
+{
+  size_t start = code.size();
+
+  for (auto &action : actions_) {
+    if (! action->compile(code)) {
+      code.resize(start);
+
+      codeStart_ = -1;
+
+      return;
+    }
+  }
+
+  // only non-basic child is tail of rule chain if it is the last instruction
+  uint num_push = 0;
+
+  for (size_t i = start; i < code.size(); ++i)
+    if (code[i].op == PUSH_RULE_INSTR)
+      ++num_push;
+
+  if (num_push == 1 && code.back().op == PUSH_RULE_INSTR && ! code.back().loop)
+    code.back().tail = true;
+
+  code.push_back(Instr());
+
+  codeStart_ = int(start);
+}
+
 void
 CContextFree::ActionList::
 expand(CContextFree *c, const State &state)
@@ -1873,15 +4325,66 @@ exec(CContextFree *c, const State &state)
 
 //-------------
 
+void
+CContextFree::SimpleAction::
+resolve(CContextFree *c)
+{
+  if (! rule_) rule_ = c->getRule(getName());
+}
+
+double
+CContextFree::SimpleAction::
+calcBound() const
+{
+  if (! rule_) return std::numeric_limits<double>::infinity();
+
+  double r = rule_->getBound();
+
+  if (std::isinf(r)) return r;
+
+  // child bound is centered on adjustment origin and scaled by it
+  return std::hypot(adj_.tx, adj_.ty) + adj_.smax*r;
+}
+
+void
+CContextFree::SimpleAction::
+visitChildren(double s, double p, double limit, const ChildProc &proc) const
+{
+  if (! rule_) return;
+
+  double s1 = s*adj_.smax;
+
+  if (s1 >= limit)
+    proc(rule_, s1, p);
+}
+
+bool
+CContextFree::SimpleAction::
+compile(Code &code) const
+{
+  Instr instr;
+
+  instr.op   = (rule_->isBasic() ? EMIT_SHAPE_INSTR : PUSH_RULE_INSTR);
+  instr.salt = index_ + 1;
+  instr.adj  = &adj_;
+  instr.rule = rule_;
+
+  code.push_back(instr);
+
+  return true;
+}
+
 void
 CContextFree::SimpleAction::
 expand(CContextFree *c, const State &state)
 {
   if (! rule_) rule_ = c->getRule(getName());
 
-  State state1 = adjustState(state, getAdjustment());
+  State state1;
+
+  if (! c->adjustChildState(state, getAdjustment(), state1)) return;
 
-  if (c->checkSizeLimit(state1)) return;
+  state1.seed = childSeed(state);
 
   c->pushRule(rule_, state1);
 }
@@ -1892,9 +4395,11 @@ exec(CContextFree *c, const State &state)
 {
   if (! rule_) rule_ = c->getRule(getName());
 
-  State state1 = adjustState(state, getAdjustment());
+  State state1;
 
-  if (c->checkSizeLimit(state1)) return;
+  if (! c->adjustChildState(state, getAdjustment(), state1)) return;
+
+  state1.seed = childSeed(state);
 
   rule_->exec(state1);
 }
@@ -1912,6 +4417,95 @@ CContextFree::LoopAction::
 {
 }
 
+void
+CContextFree::LoopAction::
+resolve(CContextFree *c)
+{
+  if (! rule_) rule_ = c->getRule(getName());
+}
+
+double
+CContextFree::LoopAction::
+calcBound() const
+{
+  if (! rule_) return std::numeric_limits<double>::infinity();
+
+  double r = rule_->getBound();
+
+  if (std::isinf(r)) return r;
+
+  // i'th child has loop adjustment applied i times before its own adjustment
+  double x = adj_.tx, y = adj_.ty, s = adj_.smax;
+
+  double bound = 0.0;
+
+  for (int i = 0; i < n_; ++i) {
+    bound = std::max(bound, std::hypot(x, y) + s*r);
+
+    nadj_.m.multiplyPoint(x, y, &x, &y);
+
+    s *= nadj_.smax;
+  }
+
+  return bound;
+}
+
+void
+CContextFree::LoopAction::
+visitChildren(double s, double p, double limit, const ChildProc &proc) const
+{
+  if (! rule_) return;
+
+  // loop ends at first child which is too small (as expand)
+  for (int i = 0; i < n_; ++i) {
+    double s1 = s*adj_.smax;
+
+    if (s1 < limit) return;
+
+    proc(rule_, s1, p);
+
+    s *= nadj_.smax;
+  }
+}
+
+bool
+CContextFree::LoopAction::
+compile(Code &code) const
+{
+  uint begin = uint(code.size());
+
+  Instr beginInstr;
+
+  beginInstr.op   = LOOP_BEGIN_INSTR;
+  beginInstr.n    = n_;
+  beginInstr.salt = index_ + 1;
+
+  code.push_back(beginInstr);
+
+  Instr bodyInstr;
+
+  bodyInstr.op   = (rule_->isBasic() ? EMIT_SHAPE_INSTR : PUSH_RULE_INSTR);
+  bodyInstr.loop = true;
+  bodyInstr.adj  = &adj_;
+  bodyInstr.rule = rule_;
+
+  code.push_back(bodyInstr);
+
+  Instr endInstr;
+
+  endInstr.op   = LOOP_END_INSTR;
+  endInstr.n    = n_;
+  endInstr.adj  = &nadj_;
+  endInstr.jump = begin + 1;
+
+  code.push_back(endInstr);
+
+  code[begin    ].jump = uint(code.size());
+  code[begin + 1].jump = uint(code.size());
+
+  return true;
+}
+
 void
 CContextFree::LoopAction::
 expand(CContextFree *c, const State &state)
@@ -1920,48 +4514,138 @@ expand(CContextFree *c, const State &state)
 
   if (! rule_) rule_ = c->getRule(getName());
 
+  uint64_t seed = childSeed(state);
+
+  for (int i = 0; i < getLoopNum(); ++i) {
+    State state2;
+
+    if (! c->adjustChildState(state1, getAdjustment(), state2)) return;
+
+    state2.seed = Rand::value(seed, uint(i));
+
+    c->pushRule(rule_, state2);
+
+    state1 = adjustState(state1, getLoopAdjustment());
+  }
+}
+
+void
+CContextFree::LoopAction::
+exec(CContextFree *c, const State &state)
+{
+  State state1 = state;
+
+  if (! rule_) rule_ = c->getRule(getName());
+
+  uint64_t seed = childSeed(state);
+
   for (int i = 0; i < getLoopNum(); ++i) {
-    State state2 = adjustState(state1, getAdjustment());
+    State state2;
+
+    if (! c->adjustChildState(state1, getAdjustment(), state2)) return;
+
+    state2.seed = Rand::value(seed, uint(i));
+
+    rule_->exec(state2);
+
+    state1 = adjustState(state1, getLoopAdjustment());
+  }
+}
+
+//-------------
+
+CContextFree::ComplexLoopAction::
+ComplexLoopAction(int n, const Adjustment &nadj, Action *action) :
+ Action(), n_(n), nadj_(nadj), action_(action)
+{
+}
+
+CContextFree::ComplexLoopAction::
+~ComplexLoopAction()
+{
+  delete action_;
+}
+
+void
+CContextFree::ComplexLoopAction::
+resolve(CContextFree *c)
+{
+  action_->resolve(c);
+}
+
+double
+CContextFree::ComplexLoopAction::
+calcBound() const
+{
+  double r = action_->calcBound();
+
+  if (std::isinf(r)) return r;
+
+  // i'th iteration runs action with loop adjustment applied i times
+  double x = 0.0, y = 0.0, s = 1.0;
+
+  double bound = 0.0;
+
+  for (int i = 0; i < n_; ++i) {
+    bound = std::max(bound, std::hypot(x, y) + s*r);
 
-    if (c->checkSizeLimit(state2)) return;
+    nadj_.m.multiplyPoint(x, y, &x, &y);
+
+    s *= nadj_.smax;
+  }
+
+  return bound;
+}
+
+void
+CContextFree::ComplexLoopAction::
+visitChildren(double s, double p, double limit, const ChildProc &proc) const
+{
+  for (int i = 0; i < n_; ++i) {
+    if (s < limit) return;
 
-    c->pushRule(rule_, state2);
+    action_->visitChildren(s, p, limit, proc);
 
-    state1 = adjustState(state1, getLoopAdjustment());
+    s *= nadj_.smax;
   }
 }
 
-void
-CContextFree::LoopAction::
-exec(CContextFree *c, const State &state)
+bool
+CContextFree::ComplexLoopAction::
+compile(Code &code) const
 {
-  State state1 = state;
+  uint begin = uint(code.size());
 
-  if (! rule_) rule_ = c->getRule(getName());
+  Instr beginInstr;
 
-  for (int i = 0; i < getLoopNum(); ++i) {
-    State state2 = adjustState(state1, getAdjustment());
+  beginInstr.op   = LOOP_BEGIN_INSTR;
+  beginInstr.n    = n_;
+  beginInstr.salt = index_ + 1;
 
-    if (c->checkSizeLimit(state2)) return;
+  code.push_back(beginInstr);
 
-    rule_->exec(state2);
+  Instr checkInstr;
 
-    state1 = adjustState(state1, getLoopAdjustment());
-  }
-}
+  checkInstr.op = LOOP_CHECK_INSTR;
 
-//-------------
+  code.push_back(checkInstr);
 
-CContextFree::ComplexLoopAction::
-ComplexLoopAction(int n, const Adjustment &nadj, Action *action) :
- Action(), n_(n), nadj_(nadj), action_(action)
-{
-}
+  if (! action_->compile(code))
+    return false;
 
-CContextFree::ComplexLoopAction::
-~ComplexLoopAction()
-{
-  delete action_;
+  Instr endInstr;
+
+  endInstr.op   = LOOP_END_INSTR;
+  endInstr.n    = n_;
+  endInstr.adj  = &nadj_;
+  endInstr.jump = begin + 1;
+
+  code.push_back(endInstr);
+
+  code[begin    ].jump = uint(code.size());
+  code[begin + 1].jump = uint(code.size());
+
+  return true;
 }
 
 void
@@ -1970,9 +4654,13 @@ expand(CContextFree *c, const State &state)
 {
   State state1 = state;
 
+  uint64_t seed = childSeed(state);
+
   for (int i = 0; i < getLoopNum(); ++i) {
     if (c->checkSizeLimit(state1)) return;
 
+    state1.seed = Rand::value(seed, uint(i));
+
     action_->expand(c, state1);
 
     state1 = adjustState(state1, getLoopAdjustment());
@@ -1985,9 +4673,13 @@ exec(CContextFree *c, const State &state)
 {
   State state1 = state;
 
+  uint64_t seed = childSeed(state);
+
   for (int i = 0; i < getLoopNum(); ++i) {
     if (c->checkSizeLimit(state1)) return;
 
+    state1.seed = Rand::value(seed, uint(i));
+
     action_->exec(c, state1);
 
     state1 = adjustState(state1, getLoopAdjustment());
@@ -2005,6 +4697,7 @@ PathAction(Path *path) :
 CContextFree::PathAction::
 ~PathAction()
 {
+  delete cache_;
 }
 
 void
@@ -2014,6 +4707,26 @@ addPart(PathPart *part)
   parts_.push_back(part);
 }
 
+void
+CContextFree::PathAction::
+resolve(CContextFree *c)
+{
+  // path geometry doesn't depend on state so record each fill/stroke once
+  if (cache_) return;
+
+  cache_ = new CContextFreePathCache;
+
+  CContextFreePath *path = c->getPath();
+
+  path->startRecord(cache_);
+
+  exec(c, State());
+
+  path->endCache();
+
+  cache_->valid = true;
+}
+
 void
 CContextFree::PathAction::
 expand(CContextFree *c, const State &state)
@@ -2022,12 +4735,18 @@ expand(CContextFree *c, const State &state)
 
   path->clear();
 
+  if (cache_ && cache_->valid)
+    path->startReplay(cache_);
+
   uint num_parts = uint(parts_.size());
 
   for (uint i = 0; i < num_parts; ++i)
     parts_[i]->expand(c, state);
 
-  if (! path->getFilled() && ! path->getStroked()) {
+  bool unfilled = (path->isReplay() ? path->hasReplayDraw() :
+                   ! path->getFilled() && ! path->getStroked());
+
+  if (unfilled) {
     State state1;
 
     CBBox2D bbox;
@@ -2036,6 +4755,8 @@ expand(CContextFree *c, const State &state)
 
     c->updateBBox(bbox);
   }
+
+  path->endCache();
 }
 
 void
@@ -2046,16 +4767,25 @@ exec(CContextFree *c, const State &state)
 
   path->clear();
 
+  if (cache_ && cache_->valid)
+    path->startReplay(cache_);
+
   uint num_parts = uint(parts_.size());
 
   for (uint i = 0; i < num_parts; ++i)
     parts_[i]->exec(c, state);
 
-  if (! path->getFilled() && ! path->getStroked()) {
+  bool unfilled = (path->isReplay() ? path->hasReplayDraw() :
+                   ! path->getFilled() && ! path->getStroked());
+
+  if (unfilled) {
     State state1;
 
     path->fill(c, state1);
   }
+
+  if (path->isReplay())
+    path->endCache();
 }
 
 //-------------
@@ -2076,30 +4806,22 @@ isBasic() const
     return false;
 }
 
+double
+CContextFree::SquareRule::
+calcBound()
+{
+  if (! actionLists_.empty())
+    return Rule::calcBound();
+
+  return 0.5*std::sqrt(2.0); // unit shape corner
+}
+
 void
 CContextFree::SquareRule::
 expand(const State &state)
 {
   if (actionLists_.empty()) {
-    double x1, y1, x2, y2, x3, y3, x4, y4;
-
-    state.m.multiplyPoint(-0.5, -0.5, &x1, &y1);
-    state.m.multiplyPoint( 0.5, -0.5, &x2, &y2);
-    state.m.multiplyPoint( 0.5,  0.5, &x3, &y3);
-    state.m.multiplyPoint(-0.5,  0.5, &x4, &y4);
-
-    CBBox2D bbox;
-
-    bbox.add(x1, y1);
-    bbox.add(x2, y2);
-    bbox.add(x3, y3);
-    bbox.add(x4, y4);
-
-    c_->updateBBox(bbox);
-
-    //-----
-
-    c_->bufferRule(state.z, this, state, bbox);
+    c_->bufferPrimitive(this, state);
 
     c_->incNumShapes();
   }
@@ -2138,46 +4860,22 @@ isBasic() const
     return false;
 }
 
+double
+CContextFree::CircleRule::
+calcBound()
+{
+  if (! actionLists_.empty())
+    return Rule::calcBound();
+
+  return 0.5; // unit shape radius
+}
+
 void
 CContextFree::CircleRule::
 expand(const State &state)
 {
   if (actionLists_.empty()) {
-    // 4 bezier cures to represent a circle
-    static const double t = 2*(sqrt(2.0) - 1)/3;
-
-    static const double x11 =  0.5, y11 =  0.0;
-    static const double x21 =  0.5, y21 =  t  , x31 =  t  , y31 =  0.5, x41 =  0.0, y41 =  0.5;
-    static const double x22 = -t  , y22 =  0.5, x32 = -0.5, y32 =  t  , x42 = -0.5, y42 =  0.0;
-    static const double x23 = -0.5, y23 = -t  , x33 = -t  , y33 = -0.5, x43 =  0.0, y43 = -0.5;
-    static const double x24 =  t  , y24 = -0.5, x34 =  0.5, y34 = -t  , x44 =  0.5, y44 =  0.0;
-
-    double tx[13], ty[13];
-
-    state.m.multiplyPoint(x11, y11, &tx[ 0], &ty[ 0]);
-    state.m.multiplyPoint(x21, y21, &tx[ 1], &ty[ 1]);
-    state.m.multiplyPoint(x31, y31, &tx[ 2], &ty[ 2]);
-    state.m.multiplyPoint(x41, y41, &tx[ 3], &ty[ 3]);
-    state.m.multiplyPoint(x22, y22, &tx[ 4], &ty[ 4]);
-    state.m.multiplyPoint(x32, y32, &tx[ 5], &ty[ 5]);
-    state.m.multiplyPoint(x42, y42, &tx[ 6], &ty[ 6]);
-    state.m.multiplyPoint(x23, y23, &tx[ 7], &ty[ 7]);
-    state.m.multiplyPoint(x33, y33, &tx[ 8], &ty[ 8]);
-    state.m.multiplyPoint(x43, y43, &tx[ 9], &ty[ 9]);
-    state.m.multiplyPoint(x24, y24, &tx[10], &ty[10]);
-    state.m.multiplyPoint(x34, y34, &tx[11], &ty[11]);
-    state.m.multiplyPoint(x44, y44, &tx[12], &ty[12]);
-
-    CBBox2D bbox;
-
-    for (int i = 0; i < 13; ++i)
-      bbox.add(tx[i], ty[i]);
-
-    c_->updateBBox(bbox);
-
-    //-----
-
-    c_->bufferRule(state.z, this, state, bbox);
+    c_->bufferPrimitive(this, state);
 
     c_->incNumShapes();
   }
@@ -2216,31 +4914,22 @@ isBasic() const
     return false;
 }
 
+double
+CContextFree::TriangleRule::
+calcBound()
+{
+  if (! actionLists_.empty())
+    return Rule::calcBound();
+
+  return 1.0/std::sqrt(3.0); // unit shape vertex
+}
+
 void
 CContextFree::TriangleRule::
 expand(const State &state)
 {
   if (actionLists_.empty()) {
-    static const double h1 = 0.5/sqrt(3.0);
-    static const double h2 = 1.0/sqrt(3.0);
-
-    double x1, y1, x2, y2, x3, y3;
-
-    state.m.multiplyPoint( 0.0,  h2, &x1, &y1);
-    state.m.multiplyPoint(-0.5, -h1, &x2, &y2);
-    state.m.multiplyPoint( 0.5, -h1, &x3, &y3);
-
-    CBBox2D bbox;
-
-    bbox.add(x1, y1);
-    bbox.add(x2, y2);
-    bbox.add(x3, y3);
-
-    c_->updateBBox(bbox);
-
-    //-----
-
-    c_->bufferRule(state.z, this, state, bbox);
+    c_->bufferPrimitive(this, state);
 
     c_->incNumShapes();
   }
@@ -2315,6 +5004,37 @@ exec(const State &state)
   Rule::exec(state);
 }
 
+double
+CContextFree::Path::
+calcBound()
+{
+  // path geometry doesn't depend on other rules so measure it once from the drawn
+  // bbox for an identity state (stroke width is added by strokeMargin_)
+  if (pathBound_ < 0.0) {
+    CBBox2D bbox = c_->bbox_;
+
+    c_->bbox_ = CBBox2D();
+
+    for (auto &actionList : actionLists_)
+      actionList->expand(c_, State());
+
+    const CBBox2D &pbbox = c_->bbox_;
+
+    pathBound_ = 0.0;
+
+    if (pbbox.isSet()) {
+      double x = std::max(std::abs(pbbox.getXMin()), std::abs(pbbox.getXMax()));
+      double y = std::max(std::abs(pbbox.getYMin()), std::abs(pbbox.getYMax()));
+
+      pathBound_ = std::hypot(x, y);
+    }
+
+    c_->bbox_ = bbox;
+  }
+
+  return pathBound_;
+}
+
 //-------------
 
 void
@@ -2323,10 +5043,12 @@ expand(CContextFree *c, const State &)
 {
   CContextFreePath *path = c->getPath();
 
+  if (path->isReplay()) return;
+
   if (path->getStroked() || path->getFilled())
     path->clearParts();
 
-  path->addPart(new CContextFreePathMoveTo(x_, y_));
+  path->moveTo(x_, y_);
 
   path->setCurrentPoint(x_, y_);
 
@@ -2348,16 +5070,18 @@ expand(CContextFree *c, const State &)
 {
   CContextFreePath *path = c->getPath();
 
+  if (path->isReplay()) return;
+
   if (path->getStroked() || path->getFilled())
     path->clearParts();
 
   if (! path->getCurrentPointSet()) {
     double x1, y1; path->getCurrentPoint(&x1, &y1);
 
-    path->addPart(new CContextFreePathMoveTo(x1, y1));
+    path->moveTo(x1, y1);
   }
 
-  path->addPart(new CContextFreePathLineTo(x_, y_));
+  path->lineTo(x_, y_);
 
   path->setCurrentPoint(x_, y_);
 }
@@ -2377,13 +5101,15 @@ expand(CContextFree *c, const State &)
 {
   CContextFreePath *path = c->getPath();
 
+  if (path->isReplay()) return;
+
   if (path->getStroked() || path->getFilled())
     path->clearParts();
 
   if (! path->getCurrentPointSet()) {
     double x1, y1; path->getCurrentPoint(&x1, &y1);
 
-    path->addPart(new CContextFreePathMoveTo(x1, y1));
+    path->moveTo(x1, y1);
   }
 
   double x1, y1;
@@ -2403,7 +5129,10 @@ expand(CContextFree *c, const State &)
   double a1 = M_PI*theta/180.0;
   double a2 = M_PI*(theta + delta)/180.0;
 
-  std::vector<C3Bezier2D> beziers;
+  // reused to avoid allocation per arc
+  static thread_local std::vector<C3Bezier2D> beziers;
+
+  beziers.clear();
 
 //CMathGeom2D ::ArcToBeziers(cx, cy, rx, ry, a1, a2, beziers);
   CArcToBezier::ArcToBeziers(cx, cy, rx, ry, a1, a2, beziers);
@@ -2424,7 +5153,7 @@ expand(CContextFree *c, const State &)
       x4 = x_; y4 = y_;
     }
 
-    path->addPart(new CContextFreePathCurve3To(x2, y2, x3, y3, x4, y4));
+    path->curveTo(x2, y2, x3, y3, x4, y4);
   }
 
   path->setCurrentPoint(x_, y_);
@@ -2445,16 +5174,18 @@ expand(CContextFree *c, const State &)
 {
   CContextFreePath *path = c->getPath();
 
+  if (path->isReplay()) return;
+
   if (path->getStroked() || path->getFilled())
     path->clearParts();
 
   if (! path->getCurrentPointSet()) {
     double x1, y1; path->getCurrentPoint(&x1, &y1);
 
-    path->addPart(new CContextFreePathMoveTo(x1, y1));
+    path->moveTo(x1, y1);
   }
 
-  path->addPart(new CContextFreePathCurve3To(x_, y_, x1_, y1_, x2_, y2_));
+  path->curveTo(x_, y_, x1_, y1_, x2_, y2_);
 
   path->setCurrentPoint(x2_, y2_);
 }
@@ -2474,9 +5205,11 @@ expand(CContextFree *c, const State &)
 {
   CContextFreePath *path = c->getPath();
 
+  if (path->isReplay()) return;
+
   if (! path->getCurrentPointSet()) return;
 
-  path->addPart(new CContextFreePathClose());
+  path->close();
 
   path->setClosed(true);
 }
@@ -2664,14 +5397,8 @@ void
 CContextFreePath::
 clearParts()
 {
-  if (! parts_.empty()) {
-    uint num_parts = uint(parts_.size());
-
-    for (uint i = 0; i < num_parts; ++i)
-      delete parts_[i];
-
-    parts_.clear();
-  }
+  verbs_ .clear();
+  coords_.clear();
 
   stroked_ = false;
   filled_  = false;
@@ -2694,218 +5421,256 @@ reset()
 
 void
 CContextFreePath::
-addPart(CContextFreePathPart *part)
+moveTo(double x, double y)
 {
-  parts_.push_back(part);
+  verbs_.push_back(MOVE_TO_VERB);
+
+  coords_.push_back(x); coords_.push_back(y);
 }
 
 void
 CContextFreePath::
-strokeBBox(CContextFree *c, const CContextFree::State &state, double w, CBBox2D &bbox)
+lineTo(double x, double y)
 {
-  uint num_parts = uint(parts_.size());
+  verbs_.push_back(LINE_TO_VERB);
 
-  for (uint i = 0; i < num_parts; ++i)
-    parts_[i]->updateBBox(c, state, bbox);
+  coords_.push_back(x); coords_.push_back(y);
+}
 
-  bbox.expand(-w/2, -w/2, w/2, w/2);
+void
+CContextFreePath::
+curveTo(double x2, double y2, double x3, double y3, double x4, double y4)
+{
+  verbs_.push_back(CURVE_TO_VERB);
 
-  stroked_ = true;
+  coords_.push_back(x2); coords_.push_back(y2);
+  coords_.push_back(x3); coords_.push_back(y3);
+  coords_.push_back(x4); coords_.push_back(y4);
 }
 
 void
 CContextFreePath::
-stroke(CContextFree *c, const CContextFree::State &state, double w)
+close()
 {
-  c->pathInit();
+  verbs_.push_back(CLOSE_VERB);
+}
 
-  uint num_parts = uint(parts_.size());
+bool
+CContextFreePath::
+hasReplayDraw() const
+{
+  return (replay_ && replayPos_ < replay_->draws.size());
+}
 
-  for (uint i = 0; i < num_parts; ++i)
-    parts_[i]->addToPath(c);
+bool
+CContextFreePath::
+recordDraw()
+{
+  if (! record_) return false;
 
-  CMatrix2D m = c->getAdjustMatrix()*state.m;
+  Cache::Draw draw;
 
-  c->pathStroke(state.color, m, w);
+  draw.verb1      = uint(record_->verbs .size());
+  draw.num_verbs  = uint(verbs_ .size());
+  draw.coord1     = uint(record_->coords.size());
+  draw.num_coords = uint(coords_.size());
 
-  c->pathTerm();
+  for (size_t i = 0; i < coords_.size(); i += 2)
+    draw.bbox.add(coords_[i], coords_[i + 1]);
 
-  stroked_ = true;
+  record_->verbs .insert(record_->verbs .end(), verbs_ .begin(), verbs_ .end());
+  record_->coords.insert(record_->coords.end(), coords_.begin(), coords_.end());
+
+  record_->draws.push_back(draw);
+
+  return true;
 }
 
-void
+CContextFreePath::Geom
 CContextFreePath::
-fillBBox(CContextFree *c, const CContextFree::State &state, CBBox2D &bbox)
+drawGeom()
 {
-  uint num_parts = uint(parts_.size());
+  Geom geom;
 
-  for (uint i = 0; i < num_parts; ++i)
-    parts_[i]->updateBBox(c, state, bbox);
+  if (replay_) {
+    const Cache::Draw &draw = replay_->draws[replayPos_++];
 
-  filled_ = true;
+    geom.verbs      = replay_->verbs .data() + draw.verb1;
+    geom.num_verbs  = draw.num_verbs;
+    geom.coords     = replay_->coords.data() + draw.coord1;
+    geom.num_coords = draw.num_coords;
+    geom.bbox       = &draw.bbox;
+  }
+  else {
+    geom.verbs      = verbs_ .data();
+    geom.num_verbs  = uint(verbs_ .size());
+    geom.coords     = coords_.data();
+    geom.num_coords = uint(coords_.size());
+  }
+
+  return geom;
 }
 
 void
 CContextFreePath::
-fill(CContextFree *c, const CContextFree::State &state)
+geomBBox(const Geom &geom, const CContextFree::State &state, CBBox2D &bbox)
 {
-  c->pathInit();
+  // axis aligned matrix maps untransformed bbox to exact bbox
+  if (geom.bbox && geom.bbox->isSet()) {
+    double a, b, c, d, tx, ty;
 
-  uint num_parts = uint(parts_.size());
+    state.m.getValues(&a, &b, &c, &d, &tx, &ty);
 
-  for (uint i = 0; i < num_parts; ++i)
-    parts_[i]->addToPath(c);
+    if (b == 0.0 && c == 0.0) {
+      double x1, y1, x2, y2;
 
-  CMatrix2D m = c->getAdjustMatrix()*state.m;
+      state.m.multiplyPoint(geom.bbox->getXMin(), geom.bbox->getYMin(), &x1, &y1);
+      state.m.multiplyPoint(geom.bbox->getXMax(), geom.bbox->getYMax(), &x2, &y2);
 
-  c->pathFill(state.color, m);
+      bbox.add(x1, y1);
+      bbox.add(x2, y2);
 
-  c->pathTerm();
+      return;
+    }
+  }
 
-  filled_ = true;
+  // close has no coords and all other points (including curve controls) are added
+  const double *p  = geom.coords;
+  const double *pe = p + geom.num_coords;
+
+  for ( ; p < pe; p += 2) {
+    double x, y;
+
+    state.m.multiplyPoint(p[0], p[1], &x, &y);
+
+    bbox.add(x, y);
+  }
 }
 
 void
 CContextFreePath::
-term(CContextFree *c)
-{
-  if (! filled_ && ! stroked_)
-    fill(c, CContextFree::State());
+addToPath(CContextFree *c, const Geom &geom)
+{
+  const double *p = geom.coords;
+
+  for (uint i = 0; i < geom.num_verbs; ++i) {
+    switch (geom.verbs[i]) {
+      case MOVE_TO_VERB:
+        c->pathMoveTo(p[0], p[1]); p += 2; break;
+      case LINE_TO_VERB:
+        c->pathLineTo(p[0], p[1]); p += 2; break;
+      case CURVE_TO_VERB:
+        c->pathCurveTo(p[0], p[1], p[2], p[3], p[4], p[5]); p += 6; break;
+      case CLOSE_VERB:
+        c->pathClose(); break;
+    }
+  }
 }
 
 void
 CContextFreePath::
-setCurrentPoint(double x, double y)
+strokeBBox(CContextFree *, const CContextFree::State &state, double w, CBBox2D &bbox)
 {
-  currentX_ = x;
-  currentY_ = y;
+  if (recordDraw()) { stroked_ = true; return; }
 
-  currentSet_ = true;
+  geomBBox(drawGeom(), state, bbox);
+
+  bbox.expand(-w/2, -w/2, w/2, w/2);
+
+  stroked_ = true;
 }
 
 void
 CContextFreePath::
-resetCurrentPoint()
+stroke(CContextFree *c, const CContextFree::State &state, double w)
 {
-  currentSet_ = false;
-}
+  if (recordDraw()) { stroked_ = true; return; }
 
-bool
-CContextFreePath::
-getCurrentPoint(double *x, double *y) const
-{
-  *x = currentX_;
-  *y = currentY_;
+  Geom geom = drawGeom();
 
-  return currentSet_;
-}
+  c->pathInit();
 
-void
-CContextFreePath::
-updateBBox(const CBBox2D &bbox)
-{
-  bbox_.add(bbox);
-}
+  addToPath(c, geom);
+
+  CMatrix2D m = c->getAdjustMatrix()*state.m;
 
-//-----
+  c->pathStroke(state.color, m, w);
 
-CContextFreePathMoveTo::
-CContextFreePathMoveTo(double x, double y) :
- CContextFreePathPart(), x_(x), y_(y)
-{
+  c->pathTerm();
+
+  stroked_ = true;
 }
 
 void
-CContextFreePathMoveTo::
-updateBBox(CContextFree *, const CContextFree::State &state, CBBox2D &bbox)
+CContextFreePath::
+fillBBox(CContextFree *, const CContextFree::State &state, CBBox2D &bbox)
 {
-  double x, y;
+  if (recordDraw()) { filled_ = true; return; }
 
-  state.m.multiplyPoint(x_, y_, &x, &y);
+  geomBBox(drawGeom(), state, bbox);
 
-  bbox.add(x, y);
+  filled_ = true;
 }
 
 void
-CContextFreePathMoveTo::
-addToPath(CContextFree *c)
+CContextFreePath::
+fill(CContextFree *c, const CContextFree::State &state)
 {
-  c->pathMoveTo(x_, y_);
-}
+  if (recordDraw()) { filled_ = true; return; }
 
-//-----
+  Geom geom = drawGeom();
 
-CContextFreePathLineTo::
-CContextFreePathLineTo(double x, double y) :
- CContextFreePathPart(), x_(x), y_(y)
-{
-}
+  c->pathInit();
 
-void
-CContextFreePathLineTo::
-updateBBox(CContextFree *, const CContextFree::State &state, CBBox2D &bbox)
-{
-  double x, y;
+  addToPath(c, geom);
 
-  state.m.multiplyPoint(x_, y_, &x, &y);
+  CMatrix2D m = c->getAdjustMatrix()*state.m;
 
-  bbox.add(x, y);
-}
+  c->pathFill(state.color, m);
 
-void
-CContextFreePathLineTo::
-addToPath(CContextFree *c)
-{
-  c->pathLineTo(x_, y_);
-}
+  c->pathTerm();
 
-//-----
+  filled_ = true;
+}
 
-CContextFreePathCurve3To::
-CContextFreePathCurve3To(double x2, double y2, double x3, double y3, double x4, double y4) :
- CContextFreePathPart(), x2_(x2), y2_(y2), x3_(x3), y3_(y3), x4_(x4), y4_(y4)
+void
+CContextFreePath::
+term(CContextFree *c)
 {
+  if (! filled_ && ! stroked_)
+    fill(c, CContextFree::State());
 }
 
 void
-CContextFreePathCurve3To::
-updateBBox(CContextFree *, const CContextFree::State &state, CBBox2D &bbox)
+CContextFreePath::
+setCurrentPoint(double x, double y)
 {
-  double x2, y2, x3, y3, x4, y4;
-
-  state.m.multiplyPoint(x2_, y2_, &x2, &y2);
-  state.m.multiplyPoint(x3_, y3_, &x3, &y3);
-  state.m.multiplyPoint(x4_, y4_, &x4, &y4);
+  currentX_ = x;
+  currentY_ = y;
 
-  bbox.add(x2, y2);
-  bbox.add(x3, y3);
-  bbox.add(x4, y4);
+  currentSet_ = true;
 }
 
 void
-CContextFreePathCurve3To::
-addToPath(CContextFree *c)
+CContextFreePath::
+resetCurrentPoint()
 {
-  c->pathCurveTo(x2_, y2_, x3_, y3_, x4_, y4_);
+  currentSet_ = false;
 }
 
-//-----
-
-CContextFreePathClose::
-CContextFreePathClose() :
- CContextFreePathPart()
+bool
+CContextFreePath::
+getCurrentPoint(double *x, double *y) const
 {
-}
+  *x = currentX_;
+  *y = currentY_;
 
-void
-CContextFreePathClose::
-updateBBox(CContextFree *, const CContextFree::State &, CBBox2D &)
-{
+  return currentSet_;
 }
 
 void
-CContextFreePathClose::
-addToPath(CContextFree *c)
+CContextFreePath::
+updateBBox(const CBBox2D &bbox)
 {
-  c->pathClose();
+  bbox_.add(bbox);
 }
@@ -787,7 +787,14 @@ double
 CEval::
 randIn(double min_val, double max_val)
 {
-  return (max_val - min_val)*((1.0*rand())/RAND_MAX) + min_val;
+  // SplitMix64 value n of seed stream
+  uint64_t z = randSeed_ + (++randCount_)*0x9e3779b97f4a7c15ULL;
+
+  z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27))*0x94d049bb133111ebULL;
+  z =  z ^ (z >> 31);
+
+  return (max_val - min_val)*((z >> 11)*(1.0/9007199254740992.0)) + min_val;
 }
 
 //------
@@ -0,0 +1,1488 @@
+#include <CContextFreeRaster.h>
+#include <CRGBUtil.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// max distance (pixels) of flattened curve or circle from the true one
+const double flatten_tol = 0.2;
+
+// stroke join miter length limit (as multiple of half width)
+const double miter_limit = 4.0;
+
+// screen tile size (pixels), shapes are rasterized one tile at a time
+const int tile_size = 64;
+
+// coverage mask quantization: size levels per doubling (1/16 to 16 pixels), rotation
+// levels per symmetry period and sub pixel offsets per axis
+const int mask_size_steps   = 32;
+const int mask_min_size     = -4*mask_size_steps;
+const int mask_num_sizes    = 8*mask_size_steps + 1;
+const int mask_rotate_steps = 32;
+const int mask_offset_steps = 8;
+
+// max difference from a similarity transform (relative to scale) for a masked shape
+const double mask_skew_tol = 0.01;
+
+// max total coverage mask values
+const size_t max_mask_data = size_t(1) << 23;
+
+}
+
+CContextFreeRaster::
+CContextFreeRaster(int w, int h) :
+ CContextFree()
+{
+  setSize(w, h);
+}
+
+void
+CContextFreeRaster::
+setSize(int w, int h)
+{
+  w_ = std::max(w, 0);
+  h_ = std::max(h, 0);
+
+  data_.assign(size_t(w_)*size_t(h_), 0);
+}
+
+uint
+CContextFreeRaster::
+getRenderThreads() const
+{
+  if (renderThreads_ > 0)
+    return renderThreads_;
+
+  return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+CRGBA
+CContextFreeRaster::
+getPixel(int x, int y) const
+{
+  if (x < 0 || y < 0 || x >= w_ || y >= h_)
+    return CRGBA(0, 0, 0, 0);
+
+  uint32_t pixel = data_[size_t(y)*w_ + x];
+
+  double a = ((pixel >> 24) & 0xff)/255.0;
+
+  if (a <= 0.0)
+    return CRGBA(0, 0, 0, 0);
+
+  double r = ((pixel      ) & 0xff)/255.0;
+  double g = ((pixel >>  8) & 0xff)/255.0;
+  double b = ((pixel >> 16) & 0xff)/255.0;
+
+  return CRGBA(std::min(r/a, 1.0), std::min(g/a, 1.0), std::min(b/a, 1.0), a);
+}
+
+void
+CContextFreeRaster::
+setView(const CBBox2D &view)
+{
+  double w = view.getWidth ();
+  double h = view.getHeight();
+
+  if (w <= 0.0 || h <= 0.0 || w_ <= 0 || h_ <= 0) {
+    m_.setIdentity();
+    return;
+  }
+
+  double s = std::min(w_/w, h_/h);
+
+  double dx = (w_ - s*w)/2;
+  double dy = (h_ - s*h)/2;
+
+  CMatrix2D m1 = CMatrix2D::translation(dx, dy);
+  CMatrix2D m2 = CMatrix2D::scale(s, -s);
+  CMatrix2D m3 = CMatrix2D::translation(-view.getXMin(), -view.getYMax());
+
+  m_ = m1*m2*m3;
+}
+
+void
+CContextFreeRaster::
+fitView(int border)
+{
+  double xmin, ymin, xmax, ymax;
+
+  if (! getTile(&xmin, &ymin, &xmax, &ymax)) {
+    const CBBox2D &bbox = getBBox();
+
+    double w = bbox.getWidth ();
+    double h = bbox.getHeight();
+
+    double b = 0.0;
+
+    if (border > 0)
+      b = std::min((border*w)/100.0, (border*h)/100.0);
+
+    xmin = bbox.getXMin() - b;
+    ymin = bbox.getYMin() - b;
+    xmax = bbox.getXMax() + b;
+    ymax = bbox.getYMax() + b;
+  }
+
+  setView(CBBox2D(xmin, ymin, xmax, ymax));
+}
+
+void
+CContextFreeRaster::
+render()
+{
+  if (getRenderThreads() <= 1) {
+    CContextFree::render();
+    return;
+  }
+
+  startRecord();
+
+  CContextFree::render();
+
+  drawRecorded();
+}
+
+void
+CContextFreeRaster::
+render(const CBBox2D &view)
+{
+  if (getRenderThreads() <= 1) {
+    CContextFree::render(view);
+    return;
+  }
+
+  startRecord();
+
+  CContextFree::render(view);
+
+  drawRecorded();
+}
+
+//-------------
+
+void
+CContextFreeRaster::
+fillBackground(const CHSVA &hsva)
+{
+  Color color;
+
+  makeColor(hsva, color);
+
+  std::fill(data_.begin(), data_.end(), color.pixel);
+}
+
+void
+CContextFreeRaster::
+fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const CHSVA &hsva)
+{
+  Color color;
+
+  makeColor(hsva, color);
+
+  double c[4] = { x1, y1, x2, y2 };
+
+  addFill(SQUARE_SHAPE, c, 4, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+fillCircle(double x, double y, double r, const CMatrix2D &m, const CHSVA &hsva)
+{
+  Color color;
+
+  makeColor(hsva, color);
+
+  double c[3] = { x, y, r };
+
+  addFill(CIRCLE_SHAPE, c, 3, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+             const CMatrix2D &m, const CHSVA &hsva)
+{
+  Color color;
+
+  makeColor(hsva, color);
+
+  double c[6] = { x1, y1, x2, y2, x3, y3 };
+
+  addFill(TRIANGLE_SHAPE, c, 6, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, uint32_t rgba)
+{
+  Color color;
+
+  makeColor(rgba, color);
+
+  double c[4] = { x1, y1, x2, y2 };
+
+  addFill(SQUARE_SHAPE, c, 4, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+fillCircle(double x, double y, double r, const CMatrix2D &m, uint32_t rgba)
+{
+  Color color;
+
+  makeColor(rgba, color);
+
+  double c[3] = { x, y, r };
+
+  addFill(CIRCLE_SHAPE, c, 3, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+             const CMatrix2D &m, uint32_t rgba)
+{
+  Color color;
+
+  makeColor(rgba, color);
+
+  double c[6] = { x1, y1, x2, y2, x3, y3 };
+
+  addFill(TRIANGLE_SHAPE, c, 6, m_*m, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+renderBatch(const ShapeRecord *shapes, uint n, const CMatrix2D &m)
+{
+  // view and batch transform are combined once and shapes refer to their record (colors
+  // come from the packed RGBA, no HSVA conversion)
+  if (! recording_)
+    matrices_.clear();
+
+  matrices_.push_back(m_*m);
+
+  uint index = uint(matrices_.size() - 1);
+
+  for (uint i = 0; i < n; ++i) {
+    Shape shape;
+
+    shape.record = &shapes[i];
+    shape.index  = index;
+
+    if (fillMask(shape))
+      continue;
+
+    fillShape(shape);
+  }
+}
+
+//-------------
+
+void
+CContextFreeRaster::
+addSquare(Raster &raster, double x1, double y1, double x2, double y2, const CMatrix2D &m)
+{
+  Point p[4];
+
+  m.multiplyPoint(x1, y1, &p[0].x, &p[0].y);
+  m.multiplyPoint(x2, y1, &p[1].x, &p[1].y);
+  m.multiplyPoint(x2, y2, &p[2].x, &p[2].y);
+  m.multiplyPoint(x1, y2, &p[3].x, &p[3].y);
+
+  addContour(raster, p, 4, false);
+}
+
+void
+CContextFreeRaster::
+addCircle(Raster &raster, double x, double y, double r, const CMatrix2D &m)
+{
+  // polygon with enough sides to be within flatten tolerance of the (transformed) circle
+  double rd = r*matrixScale(m);
+
+  uint n = 8;
+
+  if (rd > flatten_tol)
+    n = uint(std::min(std::max(std::ceil(M_PI/std::acos(1.0 - flatten_tol/rd)), 8.0), 1024.0));
+
+  double da = 2.0*M_PI/n;
+
+  double ca = std::cos(da);
+  double sa = std::sin(da);
+
+  // radius of polygon with same area as circle
+  double dx = r*std::sqrt(da/sa), dy = 0.0;
+
+  uint start = uint(raster.points.size());
+
+  for (uint i = 0; i < n; ++i) {
+    Point p;
+
+    m.multiplyPoint(x + dx, y + dy, &p.x, &p.y);
+
+    raster.points.push_back(p);
+
+    double dx1 = dx*ca - dy*sa;
+
+    dy = dx*sa + dy*ca;
+    dx = dx1;
+  }
+
+  Contour contour;
+
+  contour.start = start;
+  contour.n     = n;
+
+  raster.contours.push_back(contour);
+}
+
+void
+CContextFreeRaster::
+addTriangle(Raster &raster, double x1, double y1, double x2, double y2, double x3, double y3,
+            const CMatrix2D &m)
+{
+  Point p[3];
+
+  m.multiplyPoint(x1, y1, &p[0].x, &p[0].y);
+  m.multiplyPoint(x2, y2, &p[1].x, &p[1].y);
+  m.multiplyPoint(x3, y3, &p[2].x, &p[2].y);
+
+  addContour(raster, p, 3, false);
+}
+
+//-------------
+
+void
+CContextFreeRaster::
+pathInit()
+{
+  pathVerbs_ .clear();
+  pathCoords_.clear();
+}
+
+void
+CContextFreeRaster::
+pathTerm()
+{
+}
+
+void
+CContextFreeRaster::
+pathMoveTo(double x, double y)
+{
+  pathVerbs_.push_back(CContextFreePath::MOVE_TO_VERB);
+
+  pathCoords_.push_back(x); pathCoords_.push_back(y);
+}
+
+void
+CContextFreeRaster::
+pathLineTo(double x, double y)
+{
+  pathVerbs_.push_back(CContextFreePath::LINE_TO_VERB);
+
+  pathCoords_.push_back(x); pathCoords_.push_back(y);
+}
+
+void
+CContextFreeRaster::
+pathCurveTo(double x2, double y2, double x3, double y3, double x4, double y4)
+{
+  pathVerbs_.push_back(CContextFreePath::CURVE_TO_VERB);
+
+  pathCoords_.push_back(x2); pathCoords_.push_back(y2);
+  pathCoords_.push_back(x3); pathCoords_.push_back(y3);
+  pathCoords_.push_back(x4); pathCoords_.push_back(y4);
+}
+
+void
+CContextFreeRaster::
+pathClose()
+{
+  pathVerbs_.push_back(CContextFreePath::CLOSE_VERB);
+}
+
+void
+CContextFreeRaster::
+pathStroke(const CHSVA &hsva, const CMatrix2D &m, double w)
+{
+  CMatrix2D m1 = m_*m;
+
+  if (matrixScale(m1) <= 0.0 || w <= 0.0) return;
+
+  Color color;
+
+  makeColor(hsva, color);
+
+  addFill(PATH_SHAPE, pathCoords_.data(), uint(pathCoords_.size()), m1, w, color);
+}
+
+void
+CContextFreeRaster::
+pathFill(const CHSVA &hsva, const CMatrix2D &m)
+{
+  CMatrix2D m1 = m_*m;
+
+  if (matrixScale(m1) <= 0.0) return;
+
+  Color color;
+
+  makeColor(hsva, color);
+
+  addFill(PATH_SHAPE, pathCoords_.data(), uint(pathCoords_.size()), m1, 0.0, color);
+}
+
+void
+CContextFreeRaster::
+buildPath(const Fill &fill, Raster &raster) const
+{
+  // stroke (flat caps, miter joins) is built from a quad per segment and a join
+  // piece per vertex in design coords (width is transformed with the path), pieces
+  // overlap so each adds positive coverage
+  const CMatrix2D &m = fill.m;
+
+  flattenPath(fill, flatten_tol/matrixScale(m), raster);
+
+  if (fill.w <= 0.0) {
+    for (const auto &poly : raster.polys) {
+      if (poly.n < 3) continue;
+
+      uint start = uint(raster.points.size());
+
+      for (uint i = 0; i < poly.n; ++i) {
+        const Point &p = raster.polyPoints[poly.start + i];
+
+        Point p1;
+
+        m.multiplyPoint(p.x, p.y, &p1.x, &p1.y);
+
+        raster.points.push_back(p1);
+      }
+
+      Contour contour;
+
+      contour.start = start;
+      contour.n     = poly.n;
+
+      raster.contours.push_back(contour);
+    }
+
+    return;
+  }
+
+  double hw = fill.w/2.0;
+
+  for (const auto &poly : raster.polys) {
+    const Point *p = &raster.polyPoints[poly.start];
+
+    uint n  = poly.n;
+    uint ns = (poly.closed ? n : n - 1);
+
+    Point dir0, dir1;
+
+    bool first = true;
+
+    for (uint i = 0; i < ns; ++i) {
+      const Point &p1 = p[i];
+      const Point &p2 = p[(i + 1) % n];
+
+      double dx = p2.x - p1.x;
+      double dy = p2.y - p1.y;
+
+      double l = std::hypot(dx, dy);
+
+      if (l <= 0.0) continue;
+
+      Point d(dx/l, dy/l);
+
+      if (! first)
+        addStrokeJoin(raster, p1, dir1, d, hw, m);
+      else
+        dir0 = d;
+
+      Point q[4];
+
+      m.multiplyPoint(p1.x - d.y*hw, p1.y + d.x*hw, &q[0].x, &q[0].y);
+      m.multiplyPoint(p2.x - d.y*hw, p2.y + d.x*hw, &q[1].x, &q[1].y);
+      m.multiplyPoint(p2.x + d.y*hw, p2.y - d.x*hw, &q[2].x, &q[2].y);
+      m.multiplyPoint(p1.x + d.y*hw, p1.y - d.x*hw, &q[3].x, &q[3].y);
+
+      addContour(raster, q, 4, true);
+
+      dir1  = d;
+      first = false;
+    }
+
+    if (poly.closed && ! first)
+      addStrokeJoin(raster, p[0], dir1, dir0, hw, m);
+  }
+}
+
+void
+CContextFreeRaster::
+flattenPath(const Fill &fill, double tol, Raster &raster) const
+{
+  // split path commands into sub path polylines, curves use enough segments for
+  // tol (Wang's formula on the control point second differences)
+  Points &polyPoints = raster.polyPoints;
+  Polys  &polys      = raster.polys;
+
+  polyPoints.clear();
+  polys     .clear();
+
+  Point start, current;
+
+  bool open = false;
+
+  auto newPoly = [&](const Point &p) {
+    Poly poly;
+
+    poly.start = uint(polyPoints.size());
+
+    polys.push_back(poly);
+
+    polyPoints.push_back(p);
+
+    open = true;
+  };
+
+  auto addPoint = [&](const Point &p) {
+    if (! open) newPoly(current);
+
+    polyPoints.push_back(p);
+
+    current = p;
+  };
+
+  const double *c = fillCoords_.data() + fill.coord;
+
+  for (uint iv = 0; iv < fill.num_verbs; ++iv) {
+    auto verb = fillVerbs_[fill.verb + iv];
+
+    switch (verb) {
+      case CContextFreePath::MOVE_TO_VERB: {
+        start = current = Point(c[0], c[1]);
+
+        newPoly(start);
+
+        c += 2;
+
+        break;
+      }
+      case CContextFreePath::LINE_TO_VERB: {
+        addPoint(Point(c[0], c[1]));
+
+        c += 2;
+
+        break;
+      }
+      case CContextFreePath::CURVE_TO_VERB: {
+        Point p0 = current;
+        Point p1(c[0], c[1]), p2(c[2], c[3]), p3(c[4], c[5]);
+
+        double ddx = std::max(std::fabs(p0.x - 2*p1.x + p2.x), std::fabs(p1.x - 2*p2.x + p3.x));
+        double ddy = std::max(std::fabs(p0.y - 2*p1.y + p2.y), std::fabs(p1.y - 2*p2.y + p3.y));
+
+        double dd = std::hypot(ddx, ddy);
+
+        uint n = 1;
+
+        if (dd > 0.0 && tol > 0.0)
+          n = uint(std::min(std::max(std::ceil(std::sqrt(0.75*dd/tol)), 1.0), 256.0));
+
+        for (uint i = 1; i <= n; ++i) {
+          double t  = double(i)/n;
+          double t1 = 1.0 - t;
+
+          double b0 = t1*t1*t1, b1 = 3*t*t1*t1, b2 = 3*t*t*t1, b3 = t*t*t;
+
+          addPoint(Point(b0*p0.x + b1*p1.x + b2*p2.x + b3*p3.x,
+                         b0*p0.y + b1*p1.y + b2*p2.y + b3*p3.y));
+        }
+
+        c += 6;
+
+        break;
+      }
+      case CContextFreePath::CLOSE_VERB: {
+        if (open)
+          polys.back().closed = true;
+
+        current = start;
+        open    = false;
+
+        break;
+      }
+    }
+
+    if (! polys.empty())
+      polys.back().n = uint(polyPoints.size()) - polys.back().start;
+  }
+
+  // drop repeated end point of closed sub paths
+  for (auto &poly : polys) {
+    if (poly.closed && poly.n > 1) {
+      const Point &p1 = polyPoints[poly.start];
+      const Point &p2 = polyPoints[poly.start + poly.n - 1];
+
+      if (p1.x == p2.x && p1.y == p2.y)
+        --poly.n;
+    }
+  }
+}
+
+void
+CContextFreeRaster::
+addStrokeJoin(Raster &raster, const Point &p, const Point &d0, const Point &d1, double hw,
+              const CMatrix2D &m)
+{
+  // fill gap on outer side of turn with miter (or bevel if miter is too long)
+  double cross = d0.x*d1.y - d0.y*d1.x;
+  double dot   = d0.x*d1.x + d0.y*d1.y;
+
+  if (std::fabs(cross) < 1E-9 && dot > 0.0) return;
+
+  double s = (cross > 0.0 ? -hw : hw);
+
+  Point n0(-d0.y*s, d0.x*s);
+  Point n1(-d1.y*s, d1.x*s);
+
+  Point q[4];
+
+  m.multiplyPoint(p.x, p.y, &q[0].x, &q[0].y);
+  m.multiplyPoint(p.x + n0.x, p.y + n0.y, &q[1].x, &q[1].y);
+
+  uint n = 3;
+
+  if (1.0 + dot > 1E-9) {
+    double f = 1.0/(1.0 + dot);
+
+    Point mv((n0.x + n1.x)*f, (n0.y + n1.y)*f);
+
+    if (std::hypot(mv.x, mv.y) <= miter_limit*hw) {
+      m.multiplyPoint(p.x + mv.x, p.y + mv.y, &q[2].x, &q[2].y);
+
+      n = 4;
+    }
+  }
+
+  m.multiplyPoint(p.x + n1.x, p.y + n1.y, &q[n - 1].x, &q[n - 1].y);
+
+  addContour(raster, q, n, true);
+}
+
+//-------------
+
+void
+CContextFreeRaster::
+makeColor(const CHSVA &hsva, Color &color)
+{
+  CRGBA rgba = CRGBUtil::HSVAtoRGBA(hsva);
+
+  auto clamp = [](double v) { return float(std::min(std::max(v, 0.0), 1.0)); };
+
+  float a = clamp(rgba.getAlpha());
+
+  color.v[0] = clamp(rgba.getRed  ())*a*255.0f;
+  color.v[1] = clamp(rgba.getGreen())*a*255.0f;
+  color.v[2] = clamp(rgba.getBlue ())*a*255.0f;
+  color.v[3] = a*255.0f;
+
+  color.alpha  = a;
+  color.opaque = (a >= 1.0f);
+
+  auto pack = [](float v) { return uint32_t(v + 0.5f); };
+
+  color.pixel = (pack(color.v[0])      ) | (pack(color.v[1]) <<  8) |
+                (pack(color.v[2]) << 16) | (pack(color.v[3]) << 24);
+}
+
+void
+CContextFreeRaster::
+makeColor(uint32_t rgba, Color &color)
+{
+  float a = float((rgba >> 24) & 0xff)/255.0f;
+
+  color.v[0] = float((rgba      ) & 0xff)*a;
+  color.v[1] = float((rgba >>  8) & 0xff)*a;
+  color.v[2] = float((rgba >> 16) & 0xff)*a;
+  color.v[3] = float((rgba >> 24) & 0xff);
+
+  color.alpha  = a;
+  color.opaque = (a >= 1.0f);
+
+  auto pack = [](float v) { return uint32_t(v + 0.5f); };
+
+  color.pixel = (pack(color.v[0])      ) | (pack(color.v[1]) <<  8) |
+                (pack(color.v[2]) << 16) | (pack(color.v[3]) << 24);
+}
+
+double
+CContextFreeRaster::
+matrixScale(const CMatrix2D &m)
+{
+  // largest axis scale (upper bound of length scale for flattening)
+  double a, b, c, d, tx, ty;
+
+  m.getValues(&a, &b, &c, &d, &tx, &ty);
+
+  return std::max(std::hypot(a, c), std::hypot(b, d));
+}
+
+void
+CContextFreeRaster::
+addContour(Raster &raster, const Point *points, uint n, bool positive)
+{
+  Contour contour;
+
+  contour.start = uint(raster.points.size());
+  contour.n     = n;
+
+  if (positive) {
+    double area = 0.0;
+
+    for (uint i = 0, j = n - 1; i < n; j = i++)
+      area += points[j].x*points[i].y - points[i].x*points[j].y;
+
+    contour.sign = (area < 0.0 ? -1.0f : 1.0f);
+  }
+
+  raster.points.insert(raster.points.end(), points, points + n);
+
+  raster.contours.push_back(contour);
+}
+
+void
+CContextFreeRaster::
+addFill(ShapeKind kind, const double *coords, uint num_coords, const CMatrix2D &m,
+        double w, const Color &color)
+{
+  // keep path (current path commands) or primitive params and fill them (removed again
+  // if nothing is drawn)
+  if (! recording_) {
+    fills_     .clear();
+    fillVerbs_ .clear();
+    fillCoords_.clear();
+  }
+
+  Fill fill;
+
+  fill.kind  = kind;
+  fill.verb  = fillVerbs_ .size();
+  fill.coord = fillCoords_.size();
+  fill.w     = w;
+  fill.m     = m;
+  fill.color = color;
+
+  if (kind == PATH_SHAPE) {
+    fill.num_verbs = uint(pathVerbs_.size());
+
+    fillVerbs_.insert(fillVerbs_.end(), pathVerbs_.begin(), pathVerbs_.end());
+  }
+
+  fillCoords_.insert(fillCoords_.end(), coords, coords + num_coords);
+
+  fills_.push_back(fill);
+
+  Shape shape;
+
+  shape.index = uint(fills_.size() - 1);
+
+  if (! fillShape(shape)) {
+    fills_     .pop_back();
+    fillVerbs_ .resize(fill.verb);
+    fillCoords_.resize(fill.coord);
+  }
+}
+
+CMatrix2D
+CContextFreeRaster::
+shapeMatrix(const Shape &shape) const
+{
+  // record shape to image
+  const float *v = shape.record->m;
+
+  CMatrix2D m;
+
+  m.setValues(v[0], v[1], v[2], v[3], v[4], v[5]);
+
+  return matrices_[shape.index]*m;
+}
+
+void
+CContextFreeRaster::
+shapeColor(const Shape &shape, Color &color) const
+{
+  if (shape.record)
+    makeColor(shape.record->color, color);
+  else
+    color = fills_[shape.index].color;
+}
+
+void
+CContextFreeRaster::
+buildShape(const Shape &shape, Raster &raster) const
+{
+  // polygon of record (unit shape) or fill in image coords
+  static const double h1 = 0.5/std::sqrt(3.0);
+  static const double h2 = 1.0/std::sqrt(3.0);
+
+  raster.points  .clear();
+  raster.contours.clear();
+
+  if (shape.record) {
+    ShapeKind kind = shape.record->getKind();
+
+    if (kind == PATH_SHAPE) return;
+
+    CMatrix2D m = shapeMatrix(shape);
+
+    if      (kind == SQUARE_SHAPE)
+      addSquare(raster, -0.5, -0.5, 0.5, 0.5, m);
+    else if (kind == CIRCLE_SHAPE)
+      addCircle(raster, 0.0, 0.0, 0.5, m);
+    else
+      addTriangle(raster, 0.0, h2, -0.5, -h1, 0.5, -h1, m);
+
+    return;
+  }
+
+  const Fill &fill = fills_[shape.index];
+
+  const double *c = fillCoords_.data() + fill.coord;
+
+  if      (fill.kind == SQUARE_SHAPE)
+    addSquare(raster, c[0], c[1], c[2], c[3], fill.m);
+  else if (fill.kind == CIRCLE_SHAPE)
+    addCircle(raster, c[0], c[1], c[2], fill.m);
+  else if (fill.kind == TRIANGLE_SHAPE)
+    addTriangle(raster, c[0], c[1], c[2], c[3], c[4], c[5], fill.m);
+  else
+    buildPath(fill, raster);
+}
+
+bool
+CContextFreeRaster::
+fillShape(Shape &shape)
+{
+  // build polygon to get the pixel rect and draw it now (or record the shape, its
+  // polygon is built again per tile by drawRecorded), returns false if nothing to draw
+  if (data_.empty())
+    return false;
+
+  Raster &raster = raster_;
+
+  buildShape(shape, raster);
+
+  if (raster.points.empty())
+    return false;
+
+  double xmin = raster.points[0].x, ymin = raster.points[0].y, xmax = xmin, ymax = ymin;
+
+  for (const auto &p : raster.points) {
+    xmin = std::min(xmin, p.x); ymin = std::min(ymin, p.y);
+    xmax = std::max(xmax, p.x); ymax = std::max(ymax, p.y);
+  }
+
+  if (! std::isfinite(xmin) || ! std::isfinite(ymin) ||
+      ! std::isfinite(xmax) || ! std::isfinite(ymax))
+    return false;
+
+  // pixel rect (clipped to image in double so far away shapes can't overflow int)
+  auto clampCoord = [](double v, int max) {
+    return int(std::min(std::max(v, 0.0), double(max)));
+  };
+
+  shape.x1 = clampCoord(std::floor(xmin), w_);
+  shape.y1 = clampCoord(std::floor(ymin), h_);
+  shape.x2 = clampCoord(std::ceil (xmax), w_);
+  shape.y2 = clampCoord(std::ceil (ymax), h_);
+
+  if (shape.x1 >= shape.x2 || shape.y1 >= shape.y2)
+    return false;
+
+  drawShape(shape);
+
+  return true;
+}
+
+void
+CContextFreeRaster::
+drawShape(const Shape &shape)
+{
+  // draw tiles of shape (polygon in raster_ if not masked) or record it
+  if (recording_) {
+    shapes_.push_back(shape);
+    return;
+  }
+
+  Color color;
+
+  shapeColor(shape, color);
+
+  int tx1, ty1, tx2, ty2;
+
+  tileRange(shape, tx1, ty1, tx2, ty2);
+
+  for (int ty = ty1; ty < ty2; ++ty)
+    for (int tx = tx1; tx < tx2; ++tx)
+      rasterizeTile(shape, color, tx, ty, raster_);
+}
+
+void
+CContextFreeRaster::
+tileRange(const Shape &shape, int &tx1, int &ty1, int &tx2, int &ty2) const
+{
+  // tiles touched by shape pixel rect (clamped to image tiles)
+  int ntx = (w_ + tile_size - 1)/tile_size;
+  int nty = (h_ + tile_size - 1)/tile_size;
+
+  tx1 = std::max(shape.x1/tile_size, 0);
+  ty1 = std::max(shape.y1/tile_size, 0);
+  tx2 = std::min((shape.x2 + tile_size - 1)/tile_size, ntx);
+  ty2 = std::min((shape.y2 + tile_size - 1)/tile_size, nty);
+}
+
+void
+CContextFreeRaster::
+rasterizeTile(const Shape &shape, const Color &color, int tx, int ty, Raster &raster)
+{
+  // part of shape in tile (and image for mask rect), lines of the shape polygon in raster
+  // are clipped to it so only the tile pixels are summed
+  int x1 = std::max(shape.x1, tx*tile_size), x2 = std::min(shape.x2, (tx + 1)*tile_size);
+  int y1 = std::max(shape.y1, ty*tile_size), y2 = std::min(shape.y2, (ty + 1)*tile_size);
+
+  x2 = std::min(x2, w_);
+  y2 = std::min(y2, h_);
+
+  if (x1 >= x2 || y1 >= y2) return;
+
+  if (shape.mask >= 0) {
+    size_t mw = size_t(shape.x2 - shape.x1);
+
+    const float *cov = &maskData_[size_t(shape.mask) + size_t(y1 - shape.y1)*mw +
+                                  size_t(x1 - shape.x1)];
+
+    for (int y = y1; y < y2; ++y, cov += mw)
+      blendSpan(&data_[size_t(y)*w_ + x1], cov, uint(x2 - x1), color);
+
+    return;
+  }
+
+  // accumulation rows have two extra columns for the line coverage spill
+  uint sw = uint(x2 - x1);
+  uint sh = uint(y2 - y1);
+
+  raster.bw = sw + 2;
+
+  size_t na = size_t(raster.bw)*sh;
+
+  if (raster.acc.size() < na)
+    raster.acc.resize(na, 0.0f);
+
+  if (raster.cov.size() < sw)
+    raster.cov.resize(sw);
+
+  for (const auto &contour : raster.contours) {
+    const Point *p = &raster.points[contour.start];
+
+    for (uint i = 0, j = contour.n - 1; i < contour.n; j = i++)
+      addLine(raster, float(p[j].x - x1), float(p[j].y - y1),
+              float(p[i].x - x1), float(p[i].y - y1), contour.sign, float(sw), float(sh));
+  }
+
+  float *cov = raster.cov.data();
+
+  for (uint y = 0; y < sh; ++y) {
+    sumRow(raster, y, sw, cov);
+
+    blendSpan(&data_[size_t(y1 + y)*w_ + x1], cov, sw, color);
+  }
+}
+
+void
+CContextFreeRaster::
+sumRow(Raster &raster, uint y, uint n, float *cov)
+{
+  // sum accumulation row into span coverage (clearing the accumulation as it is read)
+  float *row = &raster.acc[size_t(y)*raster.bw];
+
+  float sum = 0.0f;
+
+  for (uint x = 0; x < n; ++x) {
+    sum += row[x];
+
+    row[x] = 0.0f;
+
+    cov[x] = std::min(std::fabs(sum), 1.0f);
+  }
+
+  row[n] = row[n + 1] = 0.0f;
+}
+
+//-------------
+
+bool
+CContextFreeRaster::
+fillMask(Shape &shape)
+{
+  // draw small record primitive from cached coverage mask if its transform is a
+  // rotation, uniform scale and optional flip (returns false to scan convert it)
+  ShapeKind kind = shape.record->getKind();
+
+  if (maxMaskSize_ <= 0.0 || kind == PATH_SHAPE || data_.empty())
+    return false;
+
+  double a, b, c, d, tx, ty;
+
+  shapeMatrix(shape).getValues(&a, &b, &c, &d, &tx, &ty);
+
+  double det = a*d - b*c;
+
+  double s = std::sqrt(std::fabs(det));
+
+  if (! (s > 0.0 && s <= maxMaskSize_))
+    return false;
+
+  double tol = mask_skew_tol*s;
+
+  if (det > 0.0) {
+    if (std::fabs(a - d) > tol || std::fabs(b + c) > tol) return false;
+  }
+  else {
+    if (std::fabs(a + d) > tol || std::fabs(b - c) > tol) return false;
+  }
+
+  // mask center pixel (keeps mask rect in int range)
+  double fx = std::floor(tx);
+  double fy = std::floor(ty);
+
+  if (! (std::fabs(fx) < 1e9 && std::fabs(fy) < 1e9))
+    return false;
+
+  // quantized size (log scale), rotation (within shape symmetry) and sub pixel offset.
+  // Flipped squares and circles look the same, a flipped triangle is turned half way.
+  int size = int(std::lround(std::log2(s)*mask_size_steps)) - mask_min_size;
+
+  // smaller than smallest mask (scan converted to almost no coverage)
+  if (size < 0)
+    return false;
+
+  size = std::min(size, mask_num_sizes - 1);
+
+  int rotate = 0;
+
+  if (kind != CIRCLE_SHAPE) {
+    double period = (kind == SQUARE_SHAPE ? 0.5*M_PI : 2.0*M_PI/3.0);
+
+    double angle = std::atan2(c, a);
+
+    if (det < 0.0 && kind == TRIANGLE_SHAPE)
+      angle += M_PI;
+
+    rotate = int(std::lround(angle*mask_rotate_steps/period)) % mask_rotate_steps;
+
+    if (rotate < 0) rotate += mask_rotate_steps;
+  }
+
+  int ox = std::min(int((tx - fx)*mask_offset_steps), mask_offset_steps - 1);
+  int oy = std::min(int((ty - fy)*mask_offset_steps), mask_offset_steps - 1);
+
+  int offset = getMask(kind, size, rotate, ox, oy);
+
+  if (offset < 0)
+    return false;
+
+  int hm = maskHalf_[kind*mask_num_sizes + size];
+
+  // whole mask rect (clipped when drawn)
+  shape.mask = offset;
+  shape.x1   = int(fx) - hm;
+  shape.y1   = int(fy) - hm;
+  shape.x2   = shape.x1 + 2*hm + 1;
+  shape.y2   = shape.y1 + 2*hm + 1;
+
+  if (shape.x2 <= 0 || shape.y2 <= 0 || shape.x1 >= w_ || shape.y1 >= h_)
+    return true;
+
+  drawShape(shape);
+
+  return true;
+}
+
+int
+CContextFreeRaster::
+getMask(ShapeKind kind, int size, int rotate, int ox, int oy)
+{
+  // built on first use: the unit shape at the quantized transform centered on pixel
+  // hm (plus offset) is scan converted into a (2*hm + 1)^2 mask
+  static const double h1 = 0.5/std::sqrt(3.0);
+  static const double h2 = 1.0/std::sqrt(3.0);
+
+  auto sizeScale = [](int size) {
+    return std::exp2(double(size + mask_min_size)/mask_size_steps);
+  };
+
+  if (maskOffsets_.empty()) {
+    maskOffsets_.assign(size_t(3*mask_num_sizes*mask_rotate_steps*
+                               mask_offset_steps*mask_offset_steps), -1);
+
+    // unit shape radius (circle polygon is slightly outside)
+    double r[3] = { 0.5*M_SQRT2, 0.55, h2 };
+
+    maskHalf_.resize(3*mask_num_sizes);
+
+    for (int k = 0; k < 3; ++k)
+      for (int i = 0; i < mask_num_sizes; ++i)
+        maskHalf_[k*mask_num_sizes + i] = int(std::ceil(sizeScale(i)*r[k])) + 1;
+  }
+
+  int &offset = maskOffsets_[(((size_t(kind)*mask_num_sizes + size)*mask_rotate_steps +
+                               rotate)*mask_offset_steps + oy)*mask_offset_steps + ox];
+
+  if (offset != -1)
+    return offset;
+
+  int hm = maskHalf_[kind*mask_num_sizes + size];
+
+  uint mw = uint(2*hm + 1);
+
+  if (maskData_.size() + size_t(mw)*mw > max_mask_data) {
+    offset = -2;
+    return offset;
+  }
+
+  double s = sizeScale(size);
+
+  double period = (kind == SQUARE_SHAPE ? 0.5*M_PI : 2.0*M_PI/3.0);
+
+  CMatrix2D m = CMatrix2D::translation(hm + (ox + 0.5)/mask_offset_steps,
+                                       hm + (oy + 0.5)/mask_offset_steps)*
+                CMatrix2D::rotation(rotate*period/mask_rotate_steps)*
+                CMatrix2D::scale(s, s);
+
+  Raster &raster = raster_;
+
+  raster.points  .clear();
+  raster.contours.clear();
+
+  if      (kind == SQUARE_SHAPE)
+    addSquare(raster, -0.5, -0.5, 0.5, 0.5, m);
+  else if (kind == CIRCLE_SHAPE)
+    addCircle(raster, 0.0, 0.0, 0.5, m);
+  else
+    addTriangle(raster, 0.0, h2, -0.5, -h1, 0.5, -h1, m);
+
+  raster.bw = mw + 2;
+
+  size_t na = size_t(raster.bw)*mw;
+
+  if (raster.acc.size() < na)
+    raster.acc.resize(na, 0.0f);
+
+  for (const auto &contour : raster.contours) {
+    const Point *p = &raster.points[contour.start];
+
+    for (uint i = 0, j = contour.n - 1; i < contour.n; j = i++)
+      addLine(raster, float(p[j].x), float(p[j].y), float(p[i].x), float(p[i].y),
+              contour.sign, float(mw), float(mw));
+  }
+
+  offset = int(maskData_.size());
+
+  maskData_.resize(maskData_.size() + size_t(mw)*mw);
+
+  for (uint y = 0; y < mw; ++y)
+    sumRow(raster, y, mw, &maskData_[size_t(offset) + size_t(y)*mw]);
+
+  return offset;
+}
+
+void
+CContextFreeRaster::
+startRecord()
+{
+  shapes_    .clear();
+  matrices_  .clear();
+  fills_     .clear();
+  fillVerbs_ .clear();
+  fillCoords_.clear();
+
+  recording_ = true;
+}
+
+void
+CContextFreeRaster::
+drawRecorded()
+{
+  // bin recorded shapes into tiles (counts then indices so each tile lists its shapes
+  // in paint order) and draw tiles on all render threads, each shape polygon is built
+  // again for each of its tiles
+  recording_ = false;
+
+  int ntx = (w_ + tile_size - 1)/tile_size;
+  int nty = (h_ + tile_size - 1)/tile_size;
+
+  uint num_tiles = uint(ntx*nty);
+
+  tileStart_.assign(num_tiles + 1, 0);
+
+  int tx1, ty1, tx2, ty2;
+
+  for (const auto &shape : shapes_) {
+    tileRange(shape, tx1, ty1, tx2, ty2);
+
+    for (int ty = ty1; ty < ty2; ++ty)
+      for (int tx = tx1; tx < tx2; ++tx)
+        ++tileStart_[ty*ntx + tx + 1];
+  }
+
+  for (uint t = 0; t < num_tiles; ++t)
+    tileStart_[t + 1] += tileStart_[t];
+
+  tileShapes_.resize(tileStart_[num_tiles]);
+
+  Starts pos(tileStart_.begin(), tileStart_.end() - 1);
+
+  for (uint i = 0; i < uint(shapes_.size()); ++i) {
+    tileRange(shapes_[i], tx1, ty1, tx2, ty2);
+
+    for (int ty = ty1; ty < ty2; ++ty)
+      for (int tx = tx1; tx < tx2; ++tx)
+        tileShapes_[pos[ty*ntx + tx]++] = i;
+  }
+
+  //---
+
+  std::atomic<uint> next_tile { 0 };
+
+  auto drawTiles = [&](Raster &raster) {
+    Color color;
+
+    while (true) {
+      uint t = next_tile++;
+
+      if (t >= num_tiles) break;
+
+      int tx = int(t) % ntx;
+      int ty = int(t) / ntx;
+
+      for (size_t i = tileStart_[t]; i < tileStart_[t + 1]; ++i) {
+        const Shape &shape = shapes_[tileShapes_[i]];
+
+        if (shape.mask < 0)
+          buildShape(shape, raster);
+
+        shapeColor(shape, color);
+
+        rasterizeTile(shape, color, tx, ty, raster);
+      }
+    }
+  };
+
+  uint num_threads = std::min(getRenderThreads(), std::max(num_tiles, 1U));
+
+  std::vector<Raster>      rasters(num_threads > 0 ? num_threads - 1 : 0);
+  std::vector<std::thread> threads;
+
+  for (auto &raster : rasters)
+    threads.push_back(std::thread(drawTiles, std::ref(raster)));
+
+  drawTiles(raster_);
+
+  for (auto &thread : threads)
+    thread.join();
+
+  shapes_    .clear();
+  matrices_  .clear();
+  fills_     .clear();
+  fillVerbs_ .clear();
+  fillCoords_.clear();
+}
+
+void
+CContextFreeRaster::
+addLine(Raster &raster, float x0, float y0, float x1, float y1, float d, float w, float h)
+{
+  // clip line to span rows, parts left or right of span are moved onto its edge
+  // (the coverage they add to the row is the same)
+  if (y0 == y1) return;
+
+  if (x0 >= w && x1 >= w) return;
+
+  if (y0 > y1) { std::swap(x0, x1); std::swap(y0, y1); d = -d; }
+
+  if (y1 <= 0.0f || y0 >= h) return;
+
+  float dxdy = (x1 - x0)/(y1 - y0);
+
+  if (y0 < 0.0f) { x0 -= y0*dxdy; y0 = 0.0f; }
+  if (y1 > h   ) { x1 -= (y1 - h)*dxdy; y1 = h; }
+
+  if (y0 >= y1) return;
+
+  // split where line crosses span edges
+  float ys[4] = { y0, 0.0f, 0.0f, y1 };
+
+  uint ny = 1;
+
+  float xe[2] = { 0.0f, w };
+
+  for (uint i = 0; i < 2; ++i) {
+    if ((x0 - xe[i])*(x1 - xe[i]) < 0.0f) {
+      float ye = y0 + (xe[i] - x0)/dxdy;
+
+      if (ye > y0 && ye < y1)
+        ys[ny++] = ye;
+    }
+  }
+
+  if (ny == 3 && ys[1] > ys[2])
+    std::swap(ys[1], ys[2]);
+
+  ys[ny] = y1;
+
+  auto xAt = [&](float y) {
+    return std::min(std::max(x0 + (y - y0)*dxdy, 0.0f), w);
+  };
+
+  for (uint i = 0; i < ny; ++i)
+    addClippedLine(raster, xAt(ys[i]), ys[i], xAt(ys[i + 1]), ys[i + 1], d);
+}
+
+void
+CContextFreeRaster::
+addClippedLine(Raster &raster, float x0, float y0, float x1, float y1, float d)
+{
+  // add signed area (d > 0 is downward) of line (y0 < y1) to accumulation rows, each
+  // pixel gets the change in coverage at its left edge so a running sum along the row
+  // gives pixel coverage
+  if (y0 >= y1) return;
+
+  float dxdy = (x1 - x0)/(y1 - y0);
+
+  float x = x0;
+
+  float xmax = float(raster.bw - 2);
+
+  uint iy1 = uint(y0);
+  uint iy2 = uint(std::ceil(y1));
+
+  for (uint iy = iy1; iy < iy2; ++iy) {
+    float *row = &raster.acc[size_t(iy)*raster.bw];
+
+    float dy = std::min(float(iy + 1), y1) - std::max(float(iy), y0);
+
+    // clamp as rounding can step just outside span
+    float xnext = std::min(std::max(x + dxdy*dy, 0.0f), xmax);
+
+    float dd = dy*d;
+
+    float xl = std::min(x, xnext);
+    float xr = std::max(x, xnext);
+
+    float xlf = std::floor(xl);
+    float xrc = std::ceil (xr);
+
+    uint il = uint(xlf);
+    uint ir = uint(xrc);
+
+    if (ir <= il + 1) {
+      // within one pixel
+      float xm = 0.5f*(x + xnext) - xlf;
+
+      row[il    ] += dd - dd*xm;
+      row[il + 1] += dd*xm;
+    }
+    else {
+      float s = 1.0f/(xr - xl);
+
+      float xlr = xl - xlf;
+      float a0  = 0.5f*s*(1.0f - xlr)*(1.0f - xlr);
+
+      float xrr = xr - xrc + 1.0f;
+      float am  = 0.5f*s*xrr*xrr;
+
+      row[il] += dd*a0;
+
+      if (ir == il + 2)
+        row[il + 1] += dd*(1.0f - a0 - am);
+      else {
+        float a1 = s*(1.5f - xlr);
+
+        row[il + 1] += dd*(a1 - a0);
+
+        for (uint ix = il + 2; ix < ir - 1; ++ix)
+          row[ix] += dd*s;
+
+        float a2 = a1 + float(ir - il - 3)*s;
+
+        row[ir - 1] += dd*(1.0f - a2 - am);
+      }
+
+      row[ir] += dd*am;
+    }
+
+    x = xnext;
+  }
+}
+
+void
+CContextFreeRaster::
+blendSpan(uint32_t *dst, const float *cov, uint n, const Color &color)
+{
+  // source over with premultiplied colors: dst = src*cov + dst*(1 - alpha*cov)
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  const __m128 src = _mm_load_ps(color.v);
+#endif
+
+  for (uint i = 0; i < n; ++i) {
+    float c = cov[i];
+
+    if (c < 1.0f/512) continue;
+
+    if (c >= 1.0f && color.opaque) {
+      dst[i] = color.pixel;
+      continue;
+    }
+
+#if defined(__SSE2__)
+    __m128i d = _mm_cvtsi32_si128(int(dst[i]));
+
+    d = _mm_unpacklo_epi16(_mm_unpacklo_epi8(d, zero), zero);
+
+    __m128 r = _mm_add_ps(_mm_mul_ps(src, _mm_set1_ps(c)),
+                          _mm_mul_ps(_mm_cvtepi32_ps(d), _mm_set1_ps(1.0f - color.alpha*c)));
+
+    __m128i ri = _mm_cvtps_epi32(r);
+
+    ri = _mm_packus_epi16(_mm_packs_epi32(ri, ri), ri);
+
+    dst[i] = uint32_t(_mm_cvtsi128_si32(ri));
+#else
+    float f = 1.0f - color.alpha*c;
+
+    uint32_t pixel = dst[i];
+
+    uint32_t r = 0;
+
+    for (uint k = 0; k < 4; ++k) {
+      float v = color.v[k]*c + float((pixel >> (8*k)) & 0xff)*f;
+
+      r |= uint32_t(std::min(std::max(v + 0.5f, 0.0f), 255.0f)) << (8*k);
+    }
+
+    dst[i] = r;
+#endif
+  }
+}
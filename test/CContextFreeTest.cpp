@@ -19,6 +19,12 @@ class CContextFreeTest : public CContextFree {
   void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
                     const CMatrix2D &m, const CHSVA &hsv) override;
 
+  void fillSquare  (double x1, double y1, double x2, double y2, const CMatrix2D &m,
+                    uint32_t rgba) override;
+  void fillCircle  (double x, double y, double r, const CMatrix2D &m, uint32_t rgba) override;
+  void fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+                    const CMatrix2D &m, uint32_t rgba) override;
+
   void pathInit   () override;
   void pathTerm   () override;
   void pathMoveTo (double x, double y) override;
@@ -28,6 +34,8 @@ class CContextFreeTest : public CContextFree {
   void pathStroke (const CHSVA &hsv, const CMatrix2D &m, double w) override;
   void pathFill   (const CHSVA &hsv, const CMatrix2D &m) override;
 
+  static uint32_t toRGBA(const CHSVA &hsv);
+
  private:
   int         id_ { 0 };
   std::string pathStr_;
@@ -119,12 +127,32 @@ void
 CContextFreeTest::
 fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const CHSVA &hsv)
 {
-  auto rgba = CRGBUtil::HSVAtoRGBA(hsv);
+  fillSquare(x1, y1, x2, y2, m, toRGBA(hsv));
+}
 
-  int r = rgba.getRedI  ();
-  int g = rgba.getGreenI();
-  int b = rgba.getBlueI ();
-  int a = rgba.getAlphaI();
+void
+CContextFreeTest::
+fillCircle(double x, double y, double radius, const CMatrix2D &m, const CHSVA &hsv)
+{
+  fillCircle(x, y, radius, m, toRGBA(hsv));
+}
+
+void
+CContextFreeTest::
+fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
+             const CMatrix2D &m, const CHSVA &hsv)
+{
+  fillTriangle(x1, y1, x2, y2, x3, y3, m, toRGBA(hsv));
+}
+
+void
+CContextFreeTest::
+fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, uint32_t rgba)
+{
+  int r = int((rgba      ) & 0xff);
+  int g = int((rgba >>  8) & 0xff);
+  int b = int((rgba >> 16) & 0xff);
+  int a = int((rgba >> 24) & 0xff);
 
   std::cout << "<rect x=\"" << x1 << "\" y=\"" << y1 << "\"" <<
                " width=\"" << (x2 - x1) << "\" height=\"" << (y2 - y1) << "\"";
@@ -149,14 +177,12 @@ fillSquare(double x1, double y1, double x2, double y2, const CMatrix2D &m, const
 
 void
 CContextFreeTest::
-fillCircle(double x, double y, double radius, const CMatrix2D &m, const CHSVA &hsv)
+fillCircle(double x, double y, double radius, const CMatrix2D &m, uint32_t rgba)
 {
-  auto rgba = CRGBUtil::HSVAtoRGBA(hsv);
-
-  int r = rgba.getRedI  ();
-  int g = rgba.getGreenI();
-  int b = rgba.getBlueI ();
-  int a = rgba.getAlphaI();
+  int r = int((rgba      ) & 0xff);
+  int g = int((rgba >>  8) & 0xff);
+  int b = int((rgba >> 16) & 0xff);
+  int a = int((rgba >> 24) & 0xff);
 
   std::cout << "<circle x=\"" << x << " y=\"" << y << " r=\"" << radius << "\"";
 
@@ -181,14 +207,12 @@ fillCircle(double x, double y, double radius, const CMatrix2D &m, const CHSVA &h
 void
 CContextFreeTest::
 fillTriangle(double x1, double y1, double x2, double y2, double x3, double y3,
-             const CMatrix2D &m, const CHSVA &hsv)
+             const CMatrix2D &m, uint32_t rgba)
 {
-  auto rgba = CRGBUtil::HSVAtoRGBA(hsv);
-
-  int r = rgba.getRedI  ();
-  int g = rgba.getGreenI();
-  int b = rgba.getBlueI ();
-  int a = rgba.getAlphaI();
+  int r = int((rgba      ) & 0xff);
+  int g = int((rgba >>  8) & 0xff);
+  int b = int((rgba >> 16) & 0xff);
+  int a = int((rgba >> 24) & 0xff);
 
   std::cout << "<polygon points=\"" << x1 << " " << y1 << " " << x2 << " " << y2 <<
                " " << x3 << " " << y3 << "\"";
@@ -328,3 +352,13 @@ pathFill(const CHSVA &hsv, const CMatrix2D &m)
 
   std::cout << "</g>\n";
 }
+
+uint32_t
+CContextFreeTest::
+toRGBA(const CHSVA &hsv)
+{
+  auto rgba = CRGBUtil::HSVAtoRGBA(hsv);
+
+  return (uint32_t(rgba.getRedI ())      ) | (uint32_t(rgba.getGreenI()) <<  8) |
+         (uint32_t(rgba.getBlueI()) << 16) | (uint32_t(rgba.getAlphaI()) << 24);
+}